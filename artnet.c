@@ -0,0 +1,149 @@
+#define _GNU_SOURCE  // for sendmmsg
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "artnet.h"
+
+#define ARTNET_HEADER_BYTES 18
+#define ARTNET_PACKET_BYTES (ARTNET_HEADER_BYTES + 512)
+
+typedef struct {
+  int sock;
+  u8 sequence;
+  int num_packets;
+  u8 (*packets)[ARTNET_PACKET_BYTES];
+  struct iovec iovs[ARTNET_MAX_PACKETS];
+#ifdef __linux__
+  struct mmsghdr msgs[ARTNET_MAX_PACKETS];
+#endif
+} artnet_sink_info;
+
+static artnet_sink_info artnet_sinks[ARTNET_MAX_SINKS];
+static int artnet_num_sinks = 0;
+
+artnet_sink artnet_new_sink(char* hostport) {
+  artnet_sink_info* info;
+  struct addrinfo hints, *result;
+  struct sockaddr_in address;
+  char host[64];
+  char* colon;
+  int port = ARTNET_DEFAULT_PORT;
+  int sock;
+
+  if (artnet_num_sinks >= ARTNET_MAX_SINKS) {
+    fprintf(stderr, "Art-Net: no more sinks available\n");
+    return -1;
+  }
+  strncpy(host, hostport, sizeof(host) - 1);
+  host[sizeof(host) - 1] = 0;
+  if (colon = strchr(host, ':')) {
+    *colon = 0;
+    port = atoi(colon + 1);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host[0] ? host : "localhost", NULL, &hints, &result)) {
+    fprintf(stderr, "Art-Net: host not found: %s\n", host);
+    return -1;
+  }
+  memcpy(&address, result->ai_addr, sizeof(address));
+  address.sin_port = htons(port);
+  freeaddrinfo(result);
+
+  // Connecting a UDP socket fixes the destination for every send.
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0 ||
+      connect(sock, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    fprintf(stderr, "Art-Net: can't open %s: %s\n", hostport, strerror(errno));
+    if (sock >= 0) close(sock);
+    return -1;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+  info = &artnet_sinks[artnet_num_sinks];
+  memset(info, 0, sizeof(artnet_sink_info));
+  info->sock = sock;
+  info->packets = malloc(ARTNET_MAX_PACKETS*ARTNET_PACKET_BYTES);
+  return artnet_num_sinks++;
+}
+
+void artnet_put_pixels(artnet_sink sink, u16 universe, int count,
+                       pixel* pixels) {
+  artnet_sink_info* info;
+  u8* packet;
+  int n, length;
+
+  if (sink < 0 || sink >= artnet_num_sinks) return;
+  info = &artnet_sinks[sink];
+  while (count > 0 && info->num_packets < ARTNET_MAX_PACKETS) {
+    n = count < ARTNET_UNIVERSE_PIXELS ? count : ARTNET_UNIVERSE_PIXELS;
+    length = (n*3 + 1) & ~1;  // DMX data length must be even
+    packet = info->packets[info->num_packets];
+    memcpy(packet, "Art-Net", 8);
+    packet[8] = 0x00;  // OpDmx, little-endian
+    packet[9] = 0x50;
+    packet[10] = 0;  // protocol version 14
+    packet[11] = 14;
+    packet[12] = 0;  // sequence, filled in by artnet_flush
+    packet[13] = 0;  // physical port
+    packet[14] = universe & 0xff;
+    packet[15] = (universe >> 8) & 0x7f;
+    packet[16] = length >> 8;
+    packet[17] = length & 0xff;
+    memcpy(packet + ARTNET_HEADER_BYTES, pixels, n*3);
+    if (length > n*3) {
+      packet[ARTNET_HEADER_BYTES + n*3] = 0;
+    }
+    info->iovs[info->num_packets].iov_base = packet;
+    info->iovs[info->num_packets].iov_len = ARTNET_HEADER_BYTES + length;
+    info->num_packets++;
+    pixels += n;
+    count -= n;
+    universe++;
+  }
+}
+
+int artnet_flush(artnet_sink sink) {
+  artnet_sink_info* info;
+  int i, sent = 0;
+
+  if (sink < 0 || sink >= artnet_num_sinks) return 0;
+  info = &artnet_sinks[sink];
+
+  // Sequence numbers run from 1 to 255; 0 would disable reordering checks.
+  info->sequence = info->sequence == 255 ? 1 : info->sequence + 1;
+  for (i = 0; i < info->num_packets; i++) {
+    info->packets[i][12] = info->sequence;
+  }
+
+#ifdef __linux__
+  // Hand the whole frame to the kernel in one system call.
+  memset(info->msgs, 0, info->num_packets*sizeof(struct mmsghdr));
+  for (i = 0; i < info->num_packets; i++) {
+    info->msgs[i].msg_hdr.msg_iov = &info->iovs[i];
+    info->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  while (sent < info->num_packets) {
+    i = sendmmsg(info->sock, info->msgs + sent, info->num_packets - sent, 0);
+    if (i < 0 && errno == EINTR) continue;
+    if (i <= 0) break;
+    sent += i;
+  }
+#else
+  for (i = 0; i < info->num_packets; i++) {
+    if (writev(info->sock, &info->iovs[i], 1) >= 0) sent++;
+  }
+#endif
+  info->num_packets = 0;
+  return sent;
+}
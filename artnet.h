@@ -0,0 +1,31 @@
+#ifndef ARTNET_H
+#define ARTNET_H
+
+#include "opc.h"
+
+// Art-Net (ArtDmx) client: sends pixel frames as UDP datagrams, one DMX
+// universe of up to 170 pixels per packet, with a sequence number per frame.
+// A lost packet just leaves some pixels a frame behind, which suits LEDs
+// better than TCP's retransmission delays.
+
+typedef s8 artnet_sink;
+
+#define ARTNET_DEFAULT_PORT 6454
+#define ARTNET_MAX_SINKS 16
+#define ARTNET_UNIVERSE_PIXELS 170
+#define ARTNET_MAX_PACKETS 512  // universes per frame
+
+// Creates a sink for "host" or "host:port".  Returns -1 on failure.
+artnet_sink artnet_new_sink(char* hostport);
+
+// Adds count pixels to the frame being assembled, starting at universe and
+// continuing into as many following universes as needed.
+void artnet_put_pixels(artnet_sink sink, u16 universe, int count,
+                       pixel* pixels);
+
+// Sends the assembled frame in one batch and starts a new one.  Packets the
+// socket can't take right now are dropped.  Returns the number of packets
+// sent.
+int artnet_flush(artnet_sink sink);
+
+#endif
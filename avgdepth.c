@@ -46,6 +46,8 @@
 #include <math.h>
 
 #include "opc.h"
+#include "color.h"
+#include "preview.h"
 #define pixel_rc(r, c) pixels[(c)*(rows) + (((c + 1) % 2) ? (r) : (rows - 1 - (r)))]
 #define old_pixel_rc(r, c) old_pixels[(c)*(rows) + (((c + 1) % 2) ? (r) : (rows - 1 - (r)))]
 
@@ -70,36 +72,17 @@ pthread_mutex_t gl_backbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
 // front: owned by GL, "currently being drawn"
 uint8_t *depth_mid, *depth_front;
 
-GLuint gl_depth_tex;
+preview_texture gl_depth_tex;
 
 freenect_context *f_ctx;
 freenect_device *f_dev;
 int freenect_angle = 0;
 int freenect_led;
 
-pthread_cond_t gl_frame_cond = PTHREAD_COND_INITIALIZER;
 int got_depth = 0;
 
 void DrawGLScene() {
-  pthread_mutex_lock(&gl_backbuf_mutex);
-
-  while (!got_depth) {
-    pthread_cond_wait(&gl_frame_cond, &gl_backbuf_mutex);
-  }
-
-  uint8_t *tmp;
-
-  if (got_depth) {
-    tmp = depth_front;
-    depth_front = depth_mid;
-    depth_mid = tmp;
-    got_depth = 0;
-  }
-
-  pthread_mutex_unlock(&gl_backbuf_mutex);
-
-  glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, depth_front);
+  preview_texture_upload(&gl_depth_tex, depth_front);
 
   glBegin(GL_TRIANGLE_FAN);
   glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
@@ -112,6 +95,35 @@ void DrawGLScene() {
   glutSwapBuffers();
 }
 
+// Runs on a GLUT timer when a preview frame is due, so that between frames
+// GLUT sleeps until the next one or an input event.
+void Tick(int value) {
+  double delay = preview_delay();
+  int got = 0;
+  uint8_t *tmp;
+
+  if (delay == 0) {
+    pthread_mutex_lock(&gl_backbuf_mutex);
+    if (got_depth) {
+      tmp = depth_front;
+      depth_front = depth_mid;
+      depth_mid = tmp;
+      got_depth = 0;
+      got = 1;
+    }
+    pthread_mutex_unlock(&gl_backbuf_mutex);
+
+    if (got) {
+      glutPostRedisplay();
+      preview_drawn();
+      delay = preview_delay();
+    } else {
+      delay = PREVIEW_POLL_INTERVAL;
+    }
+  }
+  glutTimerFunc(delay*1000, Tick, 0);
+}
+
 void keyPressed(unsigned char key, int x, int y) {
   if (key == 27) {
     die = 1;
@@ -188,10 +200,7 @@ void InitGL(int Width, int Height) {
   glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   glShadeModel(GL_FLAT);
 
-  glGenTextures(1, &gl_depth_tex);
-  glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  preview_texture_init(&gl_depth_tex, 640, 480, 3, GL_RGB, GL_UNSIGNED_BYTE, 3);
 
   ReSizeGLScene(Width, Height);
 }
@@ -208,9 +217,10 @@ void *gl_threadfunc(void *arg) {
   window = glutCreateWindow("LibFreenect");
 
   glutDisplayFunc(&DrawGLScene);
-  glutIdleFunc(&DrawGLScene);
+  glutTimerFunc(0, Tick, 0);
   glutReshapeFunc(&ReSizeGLScene);
   glutKeyboardFunc(&keyPressed);
+  glutWindowStatusFunc(&preview_window_status);
 
   InitGL(640, 480);
 
@@ -219,59 +229,7 @@ void *gl_threadfunc(void *arg) {
   return NULL;
 }
 
-uint16_t t_gamma[2048];
-
-void set_rgb_by_depth(uint16_t depth, uint8_t* rgb) {
-  if (depth == 0) {
-    rgb[0] = 0;
-    rgb[1] = 0;
-    rgb[2] = 0;
-    return;
-  }
-  int pval = t_gamma[depth];
-  pval = (pval*8) % (256*6);
-  int lb = pval & 0xff;
-  switch (pval>>8) {
-    case 0:
-      rgb[0] = 255;
-      rgb[1] = 255-lb;
-      rgb[2] = 255-lb;
-      break;
-    case 1:
-      rgb[0] = 255;
-      rgb[1] = lb;
-      rgb[2] = 0;
-      break;
-    case 2:
-      rgb[0] = 255-lb;
-      rgb[1] = 255;
-      rgb[2] = 0;
-      break;
-    case 3:
-      rgb[0] = 0;
-      rgb[1] = 255;
-      rgb[2] = lb;
-      break;
-    case 4:
-      rgb[0] = 0;
-      rgb[1] = 255-lb;
-      rgb[2] = 255;
-      break;
-    case 5:
-      rgb[0] = 0;
-      rgb[1] = 0;
-      rgb[2] = 255-lb;
-      break;
-    default:
-      rgb[0] = 0;
-      rgb[1] = 0;
-      rgb[2] = 0;
-      break;
-  }
-  rgb[0] >>= 2;
-  rgb[1] >>= 2;
-  rgb[2] >>= 2;
-}
+pixel depth_colors[2048];
 
 pixel old_pixels[625];
 
@@ -287,11 +245,7 @@ void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp) {
 
   pthread_mutex_lock(&gl_backbuf_mutex);
   for (i = 0; i < 640*480; i++) {
-    if (depth[i] < max_depth) {
-      set_rgb_by_depth(depth[i], &(depth_mid[3*i]));
-    } else {
-      set_rgb_by_depth(0, &(depth_mid[3*i]));
-    }
+    ((pixel*) depth_mid)[i] = depth_colors[depth[i] < max_depth ? depth[i] : 0];
   }
   for (r = 0; r < rows; r++) {
     for (c = 0; c < cols; c++) {
@@ -311,7 +265,7 @@ void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp) {
       if (i > 0) {
         avg = avg / i;
       }
-      set_rgb_by_depth(avg, &px);
+      px = depth_colors[(int) avg];
       //op = (uint8_t*) &(old_pixels[r*cols + c]);
       //np = (uint8_t*) &(pixels[r*cols + c]);
       op = &(old_pixel_rc(r, c));
@@ -323,7 +277,6 @@ void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp) {
   }
 
   got_depth++;
-  pthread_cond_signal(&gl_frame_cond);
   pthread_mutex_unlock(&gl_backbuf_mutex);
 
   opc_put_pixels(sink, 1, rows*cols, pixels);
@@ -364,10 +317,15 @@ int main(int argc, char **argv) {
   depth_front = (uint8_t*)malloc(640*480*3);
 
   int i;
-  for (i=0; i<2048; i++) {
+  color_init();
+  depth_colors[0] = color_kinect_ramp(-1);
+  for (i=1; i<2048; i++) {
     float v = i/2048.0;
     v = powf(v, 3)* 6;
-    t_gamma[i] = v*6*256;
+    depth_colors[i] = color_kinect_ramp(((int) (v*6*256)*8) % (256*6));
+    depth_colors[i].r >>= 2;
+    depth_colors[i].g >>= 2;
+    depth_colors[i].b >>= 2;
   }
 
   g_argc = argc;
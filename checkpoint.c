@@ -0,0 +1,57 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "clock.h"
+
+typedef struct {
+  char version[60];  // with size, 64 bytes, keeping what follows aligned
+  u32 size;
+} checkpoint_header;
+
+void* checkpoint_open(char* shm_name, int size, char* version) {
+  int total = sizeof(checkpoint_header) + size;
+  checkpoint_header* h = MAP_FAILED;
+  struct stat st;
+  int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644);
+  int keep;
+
+  if (fd < 0) {
+    fprintf(stderr, "Checkpoint: no shared memory at %s\n", shm_name);
+    return NULL;
+  }
+  keep = fstat(fd, &st) == 0 && st.st_size == total;
+  if (keep || ftruncate(fd, total) == 0) {
+    h = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (h == MAP_FAILED) {
+    fprintf(stderr, "Checkpoint: can't map %s\n", shm_name);
+    return NULL;
+  }
+  if (!keep || h->size != size || strncmp(h->version, version, 59)) {
+    memset(h, 0, total);
+    strncpy(h->version, version, 59);
+    h->size = size;
+  }
+  return h + 1;
+}
+
+void checkpoint_begin(checkpoint_section* s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void checkpoint_end(checkpoint_section* s) {
+  s->time = get_time();
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+int checkpoint_valid(checkpoint_section* s, double max_age) {
+  u32 seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+  return seq && !(seq & 1) && get_time() - s->time < max_age;
+}
@@ -0,0 +1,30 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "opc.h"
+
+// State kept in POSIX shared memory, where it outlives the process, so that
+// the next run can pick up where this one left off.  The state is divided
+// into sections, each written by one thread between checkpoint_begin() and
+// checkpoint_end(); a section that was being written when the process died
+// is never read back.
+
+typedef struct {
+  volatile u32 seq;  // odd while the section is being written
+  volatile double time;  // CLOCK_MONOTONIC seconds when last written
+} checkpoint_section;
+
+// Maps size bytes of shared memory under shm_name (like "/play").  The
+// contents are kept if they were written by a program with the same
+// version string and size, and cleared otherwise.  Returns NULL if there's
+// no shared memory to be had.
+void* checkpoint_open(char* shm_name, int size, char* version);
+
+void checkpoint_begin(checkpoint_section* s);
+void checkpoint_end(checkpoint_section* s);
+
+// Returns 1 if a section was completely written within the last max_age
+// seconds.
+int checkpoint_valid(checkpoint_section* s, double max_age);
+
+#endif
@@ -0,0 +1,63 @@
+#include "color.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define set_pixel(p, nr, ng, nb) ((p).r = nr, (p).g = ng, (p).b = nb)
+
+pixel color_hues[HUE_STEPS];
+
+void color_init() {
+  int k;
+  for (k = 0; k < HUE_STEPS; k++) {
+    if (k < 255) {
+      set_pixel(color_hues[k], 255 - k, k, 0);
+    } else if (k < 510) {
+      set_pixel(color_hues[k], 0, 255 - (k - 255), k - 255);
+    } else {
+      set_pixel(color_hues[k], k - 510, 0, 255 - (k - 510));
+    }
+  }
+}
+
+pixel color_kinect_ramp(int v) {
+  pixel p;
+  int hi = v >> 8, lo = v & 0xff;
+  v < 0 ? set_pixel(p, 0, 0, 0) :
+      hi == 0 ? set_pixel(p, 255, 255 - lo, 255 - lo) :
+      hi == 1 ? set_pixel(p, 255, lo, 0) :
+      hi == 2 ? set_pixel(p, 255 - lo, 255, 0) :
+      hi == 3 ? set_pixel(p, 0, 255, lo) :
+      hi == 4 ? set_pixel(p, 0, 255 - lo, 255) :
+      hi == 5 ? set_pixel(p, 0, 0, 255 - lo) :
+      set_pixel(p, 0, 0, 0);
+  return p;
+}
+
+void color_map_depth(pixel* out, u16* depth, int count,
+                     pixel* table, u16 max_index) {
+  int i = 0;
+#ifdef __SSE2__
+  // Clamp eight depths at a time (min(d, m) = d - sat(d - m)), then gather.
+  u16 index[8] __attribute__((aligned(16)));
+  __m128i limit = _mm_set1_epi16(max_index);
+  __m128i d;
+  for (; i + 8 <= count; i += 8) {
+    d = _mm_loadu_si128((__m128i*) (depth + i));
+    d = _mm_sub_epi16(d, _mm_subs_epu16(d, limit));
+    _mm_store_si128((__m128i*) index, d);
+    out[i] = table[index[0]];
+    out[i + 1] = table[index[1]];
+    out[i + 2] = table[index[2]];
+    out[i + 3] = table[index[3]];
+    out[i + 4] = table[index[4]];
+    out[i + 5] = table[index[5]];
+    out[i + 6] = table[index[6]];
+    out[i + 7] = table[index[7]];
+  }
+#endif
+  for (; i < count; i++) {
+    out[i] = table[depth[i] < max_index ? depth[i] : max_index];
+  }
+}
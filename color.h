@@ -0,0 +1,31 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+#include "opc.h"
+
+// Colour tables shared by play and the depth viewers.  Call color_init()
+// once before using any of them.
+
+#define HUE_STEPS (255*3)
+#define KINECT_RAMP_STEPS (256*6)
+
+extern pixel color_hues[HUE_STEPS];
+
+void color_init();
+
+// Fully saturated colour for a hue; the hue wheel repeats every 1.0.
+static inline pixel hue_pixel(float hue) {
+  int k = (hue - (int) hue) * (double) HUE_STEPS;
+  return color_hues[k < 0 ? k + HUE_STEPS : k];
+}
+
+// The OpenKinect demo ramp: white, red, yellow, green, cyan, blue, black,
+// for v in [0, KINECT_RAMP_STEPS); anything else is black.
+pixel color_kinect_ramp(int v);
+
+// Colourizes count depth values through table, clamping each depth to
+// max_index first.
+void color_map_depth(pixel* out, u16* depth, int count,
+                     pixel* table, u16 max_index);
+
+#endif
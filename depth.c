@@ -45,6 +45,9 @@
 
 #include <math.h>
 
+#include "color.h"
+#include "preview.h"
+
 pthread_t freenect_thread;
 volatile int die = 0;
 
@@ -60,36 +63,17 @@ pthread_mutex_t gl_backbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
 // front: owned by GL, "currently being drawn"
 uint8_t *depth_mid, *depth_front;
 
-GLuint gl_depth_tex;
+preview_texture gl_depth_tex;
 
 freenect_context *f_ctx;
 freenect_device *f_dev;
 int freenect_angle = 0;
 int freenect_led;
 
-pthread_cond_t gl_frame_cond = PTHREAD_COND_INITIALIZER;
 int got_depth = 0;
 
 void DrawGLScene() {
-  pthread_mutex_lock(&gl_backbuf_mutex);
-
-  while (!got_depth) {
-    pthread_cond_wait(&gl_frame_cond, &gl_backbuf_mutex);
-  }
-
-  uint8_t *tmp;
-
-  if (got_depth) {
-    tmp = depth_front;
-    depth_front = depth_mid;
-    depth_mid = tmp;
-    got_depth = 0;
-  }
-
-  pthread_mutex_unlock(&gl_backbuf_mutex);
-
-  glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, depth_front);
+  preview_texture_upload(&gl_depth_tex, depth_front);
 
   glBegin(GL_TRIANGLE_FAN);
   glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
@@ -102,6 +86,35 @@ void DrawGLScene() {
   glutSwapBuffers();
 }
 
+// Runs on a GLUT timer when a preview frame is due, so that between frames
+// GLUT sleeps until the next one or an input event.
+void Tick(int value) {
+  double delay = preview_delay();
+  int got = 0;
+  uint8_t *tmp;
+
+  if (delay == 0) {
+    pthread_mutex_lock(&gl_backbuf_mutex);
+    if (got_depth) {
+      tmp = depth_front;
+      depth_front = depth_mid;
+      depth_mid = tmp;
+      got_depth = 0;
+      got = 1;
+    }
+    pthread_mutex_unlock(&gl_backbuf_mutex);
+
+    if (got) {
+      glutPostRedisplay();
+      preview_drawn();
+      delay = preview_delay();
+    } else {
+      delay = PREVIEW_POLL_INTERVAL;
+    }
+  }
+  glutTimerFunc(delay*1000, Tick, 0);
+}
+
 void keyPressed(unsigned char key, int x, int y) {
   if (key == 27) {
     die = 1;
@@ -172,10 +185,7 @@ void InitGL(int Width, int Height) {
   glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   glShadeModel(GL_FLAT);
 
-  glGenTextures(1, &gl_depth_tex);
-  glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  preview_texture_init(&gl_depth_tex, 640, 480, 3, GL_RGB, GL_UNSIGNED_BYTE, 3);
 
   ReSizeGLScene(Width, Height);
 }
@@ -192,9 +202,10 @@ void *gl_threadfunc(void *arg) {
   window = glutCreateWindow("LibFreenect");
 
   glutDisplayFunc(&DrawGLScene);
-  glutIdleFunc(&DrawGLScene);
+  glutTimerFunc(0, Tick, 0);
   glutReshapeFunc(&ReSizeGLScene);
   glutKeyboardFunc(&keyPressed);
+  glutWindowStatusFunc(&preview_window_status);
 
   InitGL(640, 480);
 
@@ -203,56 +214,14 @@ void *gl_threadfunc(void *arg) {
   return NULL;
 }
 
-uint16_t t_gamma[2048];
+pixel depth_colors[2048];
 
 void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp) {
-  int i;
   uint16_t *depth = (uint16_t*)v_depth;
 
   pthread_mutex_lock(&gl_backbuf_mutex);
-  for (i=0; i<640*480; i++) {
-    int pval = t_gamma[depth[i]];
-    int lb = pval & 0xff;
-    switch (pval>>8) {
-      case 0:
-        depth_mid[3*i+0] = 255;
-        depth_mid[3*i+1] = 255-lb;
-        depth_mid[3*i+2] = 255-lb;
-        break;
-      case 1:
-        depth_mid[3*i+0] = 255;
-        depth_mid[3*i+1] = lb;
-        depth_mid[3*i+2] = 0;
-        break;
-      case 2:
-        depth_mid[3*i+0] = 255-lb;
-        depth_mid[3*i+1] = 255;
-        depth_mid[3*i+2] = 0;
-        break;
-      case 3:
-        depth_mid[3*i+0] = 0;
-        depth_mid[3*i+1] = 255;
-        depth_mid[3*i+2] = lb;
-        break;
-      case 4:
-        depth_mid[3*i+0] = 0;
-        depth_mid[3*i+1] = 255-lb;
-        depth_mid[3*i+2] = 255;
-        break;
-      case 5:
-        depth_mid[3*i+0] = 0;
-        depth_mid[3*i+1] = 0;
-        depth_mid[3*i+2] = 255-lb;
-        break;
-      default:
-        depth_mid[3*i+0] = 0;
-        depth_mid[3*i+1] = 0;
-        depth_mid[3*i+2] = 0;
-        break;
-    }
-  }
+  color_map_depth((pixel*) depth_mid, depth, 640*480, depth_colors, 2047);
   got_depth++;
-  pthread_cond_signal(&gl_frame_cond);
   pthread_mutex_unlock(&gl_backbuf_mutex);
 }
 
@@ -283,10 +252,11 @@ int main(int argc, char **argv) {
   depth_front = (uint8_t*)malloc(640*480*3);
 
   int i;
+  color_init();
   for (i=0; i<2048; i++) {
     float v = i/2048.0;
     v = powf(v, 3)* 6;
-    t_gamma[i] = v*6*256;
+    depth_colors[i] = color_kinect_ramp(v*6*256);
   }
 
   g_argc = argc;
@@ -0,0 +1,79 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "filewatch.h"
+#include "clock.h"
+
+static time_t filewatch_mtime(char* name) {
+  struct stat st;
+  return stat(name, &st) == 0 ? st.st_mtime : 0;
+}
+
+void filewatch_init(filewatch* w) {
+  memset(w, 0, sizeof(filewatch));
+  w->fd = -1;
+#ifdef __linux__
+  // Watch the directory, to catch files that are replaced by renaming.
+  w->fd = inotify_init1(IN_NONBLOCK);
+  if (w->fd >= 0 && inotify_add_watch(w->fd, ".", IN_CLOSE_WRITE |
+                                      IN_MOVED_TO) < 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+#endif
+}
+
+int filewatch_add(filewatch* w, char* name) {
+  if (w->count >= FILEWATCH_MAX) return -1;
+  w->names[w->count] = name;
+  w->mtimes[w->count] = filewatch_mtime(name);
+  return w->count++;
+}
+
+int filewatch_poll(filewatch* w) {
+  double now;
+  time_t mtime;
+  int i;
+#ifdef __linux__
+  char buffer[4096]
+      __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event* e;
+  ssize_t n;
+  char* p;
+
+  if (w->fd >= 0) {
+    while ((n = read(w->fd, buffer, sizeof(buffer))) > 0) {
+      for (p = buffer; p < buffer + n; p += sizeof(*e) + e->len) {
+        e = (struct inotify_event*) p;
+        for (i = 0; i < w->count && e->len; i++) {
+          if (strcmp(e->name, w->names[i]) == 0) {
+            w->pending |= 1 << i;
+          }
+        }
+      }
+    }
+  }
+#endif
+  now = get_time();
+  if (w->fd < 0 && now >= w->next_poll) {
+    w->next_poll = now + FILEWATCH_POLL_INTERVAL;
+    for (i = 0; i < w->count; i++) {
+      mtime = filewatch_mtime(w->names[i]);
+      if (mtime != w->mtimes[i]) {
+        w->mtimes[i] = mtime;
+        w->pending |= 1 << i;
+      }
+    }
+  }
+  for (i = 0; i < w->count; i++) {
+    if (w->pending & (1 << i)) {
+      w->pending &= ~(1 << i);
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,30 @@
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include <time.h>
+
+// Notices when files in the current directory are written or replaced:
+// with inotify on Linux, or elsewhere by checking their modification times
+// at most once every FILEWATCH_POLL_INTERVAL seconds.
+#define FILEWATCH_MAX 8
+#define FILEWATCH_POLL_INTERVAL 1.0
+
+typedef struct {
+  int fd;  // inotify, or -1
+  int count;
+  char* names[FILEWATCH_MAX];
+  time_t mtimes[FILEWATCH_MAX];
+  double next_poll;
+  unsigned pending;  // a bit for each file changed but not yet reported
+} filewatch;
+
+void filewatch_init(filewatch* w);
+
+// Watches a file, by name; returns its index.
+int filewatch_add(filewatch* w, char* name);
+
+// Returns the index of a file that has changed since the last call, or -1
+// if none has.  Never blocks.
+int filewatch_poll(filewatch* w);
+
+#endif
@@ -45,6 +45,9 @@
 
 #include <math.h>
 
+#include "color.h"
+#include "preview.h"
+
 pthread_t freenect_thread;
 volatile int die = 0;
 
@@ -61,8 +64,9 @@ pthread_mutex_t gl_backbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
 uint8_t *depth_mid, *depth_front;
 uint8_t *rgb_back, *rgb_mid, *rgb_front;
 
-GLuint gl_depth_tex;
-GLuint gl_rgb_tex;
+preview_texture gl_depth_tex;
+preview_texture gl_rgb_tex;
+freenect_video_format gl_rgb_tex_format;
 
 freenect_context *f_ctx;
 freenect_device *f_dev;
@@ -72,50 +76,24 @@ int freenect_led;
 freenect_video_format requested_format = FREENECT_VIDEO_RGB;
 freenect_video_format current_format = FREENECT_VIDEO_RGB;
 
-pthread_cond_t gl_frame_cond = PTHREAD_COND_INITIALIZER;
 int got_rgb = 0;
 int got_depth = 0;
 
-void DrawGLScene()
+void InitRGBTexture(freenect_video_format format)
 {
-	pthread_mutex_lock(&gl_backbuf_mutex);
-
-	// When using YUV_RGB mode, RGB frames only arrive at 15Hz, so we shouldn't force them to draw in lock-step.
-	// However, this is CPU/GPU intensive when we are receiving frames in lockstep.
-	if (current_format == FREENECT_VIDEO_YUV_RGB) {
-		while (!got_depth && !got_rgb) {
-			pthread_cond_wait(&gl_frame_cond, &gl_backbuf_mutex);
-		}
-	} else {
-		while ((!got_depth || !got_rgb) && requested_format != current_format) {
-			pthread_cond_wait(&gl_frame_cond, &gl_backbuf_mutex);
-		}
-	}
+	if (format == FREENECT_VIDEO_RGB || format == FREENECT_VIDEO_YUV_RGB)
+		preview_texture_init(&gl_rgb_tex, 640, 480, 3, GL_RGB, GL_UNSIGNED_BYTE, 3);
+	else
+		preview_texture_init(&gl_rgb_tex, 640, 480, 1, GL_LUMINANCE, GL_UNSIGNED_BYTE, 1);
+	gl_rgb_tex_format = format;
+}
 
-	if (requested_format != current_format) {
-		pthread_mutex_unlock(&gl_backbuf_mutex);
+void DrawGLScene()
+{
+	if (requested_format != current_format)
 		return;
-	}
 
-	uint8_t *tmp;
-
-	if (got_depth) {
-		tmp = depth_front;
-		depth_front = depth_mid;
-		depth_mid = tmp;
-		got_depth = 0;
-	}
-	if (got_rgb) {
-		tmp = rgb_front;
-		rgb_front = rgb_mid;
-		rgb_mid = tmp;
-		got_rgb = 0;
-	}
-
-	pthread_mutex_unlock(&gl_backbuf_mutex);
-
-	glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, depth_front);
+	preview_texture_upload(&gl_depth_tex, depth_front);
 
 	glBegin(GL_TRIANGLE_FAN);
 	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
@@ -125,11 +103,14 @@ void DrawGLScene()
 	glTexCoord2f(0, 1); glVertex3f(0,480,0);
 	glEnd();
 
-	glBindTexture(GL_TEXTURE_2D, gl_rgb_tex);
+	if (current_format != gl_rgb_tex_format) {
+		preview_texture_free(&gl_rgb_tex);
+		InitRGBTexture(current_format);
+	}
 	if (current_format == FREENECT_VIDEO_RGB || current_format == FREENECT_VIDEO_YUV_RGB)
-		glTexImage2D(GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, rgb_front);
+		preview_texture_upload(&gl_rgb_tex, rgb_front);
 	else
-		glTexImage2D(GL_TEXTURE_2D, 0, 1, 640, 480, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, rgb_front+640*4);
+		preview_texture_upload(&gl_rgb_tex, rgb_front+640*4);
 
 	glBegin(GL_TRIANGLE_FAN);
 	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
@@ -142,6 +123,45 @@ void DrawGLScene()
 	glutSwapBuffers();
 }
 
+// Runs on a GLUT timer when a preview frame is due, so that between frames
+// GLUT sleeps until the next one or an input event.  A new frame of either
+// kind is drawn: in YUV_RGB mode, RGB frames only arrive at 15Hz.
+void Tick(int value)
+{
+	double delay = preview_delay();
+	int got = 0;
+	uint8_t *tmp;
+
+	if (delay == 0) {
+		pthread_mutex_lock(&gl_backbuf_mutex);
+		if (requested_format == current_format && (got_depth || got_rgb)) {
+			if (got_depth) {
+				tmp = depth_front;
+				depth_front = depth_mid;
+				depth_mid = tmp;
+				got_depth = 0;
+			}
+			if (got_rgb) {
+				tmp = rgb_front;
+				rgb_front = rgb_mid;
+				rgb_mid = tmp;
+				got_rgb = 0;
+			}
+			got = 1;
+		}
+		pthread_mutex_unlock(&gl_backbuf_mutex);
+
+		if (got) {
+			glutPostRedisplay();
+			preview_drawn();
+			delay = preview_delay();
+		} else {
+			delay = PREVIEW_POLL_INTERVAL;
+		}
+	}
+	glutTimerFunc(delay*1000, Tick, 0);
+}
+
 void keyPressed(unsigned char key, int x, int y)
 {
 	if (key == 27) {
@@ -227,15 +247,8 @@ void InitGL(int Width, int Height)
 	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glShadeModel(GL_FLAT);
 
-	glGenTextures(1, &gl_depth_tex);
-	glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-	glGenTextures(1, &gl_rgb_tex);
-	glBindTexture(GL_TEXTURE_2D, gl_rgb_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	preview_texture_init(&gl_depth_tex, 640, 480, 3, GL_RGB, GL_UNSIGNED_BYTE, 3);
+	InitRGBTexture(current_format);
 
 	ReSizeGLScene(Width, Height);
 }
@@ -253,9 +266,10 @@ void *gl_threadfunc(void *arg)
 	window = glutCreateWindow("LibFreenect");
 
 	glutDisplayFunc(&DrawGLScene);
-	glutIdleFunc(&DrawGLScene);
+	glutTimerFunc(0, Tick, 0);
 	glutReshapeFunc(&ReSizeGLScene);
 	glutKeyboardFunc(&keyPressed);
+	glutWindowStatusFunc(&preview_window_status);
 
 	InitGL(1280, 480);
 
@@ -264,57 +278,15 @@ void *gl_threadfunc(void *arg)
 	return NULL;
 }
 
-uint16_t t_gamma[2048];
+pixel depth_colors[2048];
 
 void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp)
 {
-	int i;
 	uint16_t *depth = (uint16_t*)v_depth;
 
 	pthread_mutex_lock(&gl_backbuf_mutex);
-	for (i=0; i<640*480; i++) {
-		int pval = t_gamma[depth[i]];
-		int lb = pval & 0xff;
-		switch (pval>>8) {
-			case 0:
-				depth_mid[3*i+0] = 255;
-				depth_mid[3*i+1] = 255-lb;
-				depth_mid[3*i+2] = 255-lb;
-				break;
-			case 1:
-				depth_mid[3*i+0] = 255;
-				depth_mid[3*i+1] = lb;
-				depth_mid[3*i+2] = 0;
-				break;
-			case 2:
-				depth_mid[3*i+0] = 255-lb;
-				depth_mid[3*i+1] = 255;
-				depth_mid[3*i+2] = 0;
-				break;
-			case 3:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 255;
-				depth_mid[3*i+2] = lb;
-				break;
-			case 4:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 255-lb;
-				depth_mid[3*i+2] = 255;
-				break;
-			case 5:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 0;
-				depth_mid[3*i+2] = 255-lb;
-				break;
-			default:
-				depth_mid[3*i+0] = 0;
-				depth_mid[3*i+1] = 0;
-				depth_mid[3*i+2] = 0;
-				break;
-		}
-	}
+	color_map_depth((pixel*) depth_mid, depth, 640*480, depth_colors, 2047);
 	got_depth++;
-	pthread_cond_signal(&gl_frame_cond);
 	pthread_mutex_unlock(&gl_backbuf_mutex);
 }
 
@@ -329,7 +301,6 @@ void rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp)
 	rgb_mid = (uint8_t*)rgb;
 
 	got_rgb++;
-	pthread_cond_signal(&gl_frame_cond);
 	pthread_mutex_unlock(&gl_backbuf_mutex);
 }
 
@@ -397,10 +368,11 @@ int main(int argc, char **argv)
 	printf("Kinect camera test\n");
 
 	int i;
+	color_init();
 	for (i=0; i<2048; i++) {
 		float v = i/2048.0;
 		v = powf(v, 3)* 6;
-		t_gamma[i] = v*6*256;
+		depth_colors[i] = color_kinect_ramp(v*6*256);
 	}
 
 	g_argc = argc;
@@ -0,0 +1,49 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "heartbeat.h"
+#include "clock.h"
+
+heartbeat_table* heartbeat_open(char* shm_name) {
+  heartbeat_table* t = MAP_FAILED;
+  int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644);
+
+  if (fd >= 0 && ftruncate(fd, sizeof(heartbeat_table)) == 0) {
+    t = mmap(NULL, sizeof(heartbeat_table), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (t == MAP_FAILED) {
+    fprintf(stderr, "Heartbeats: no shared memory at %s\n", shm_name);
+    t = malloc(sizeof(heartbeat_table));
+  }
+  memset(t, 0, sizeof(heartbeat_table));
+  t->pid = getpid();
+  return t;
+}
+
+heartbeat* heartbeat_add(heartbeat_table* t, char* name) {
+  heartbeat* h;
+  if (t->count >= HEARTBEAT_MAX) return NULL;
+  h = &t->beats[t->count];
+  strncpy(h->name, name, sizeof(h->name) - 1);
+  h->last_beat = get_time();
+  __atomic_store_n(&t->count, t->count + 1, __ATOMIC_RELEASE);
+  return h;
+}
+
+void heartbeat_beat(heartbeat* h) {
+  if (!h) return;
+  h->last_beat = get_time();
+  h->beats++;
+}
+
+double heartbeat_age(heartbeat* h) {
+  return h ? get_time() - h->last_beat : 0;
+}
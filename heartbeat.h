@@ -0,0 +1,40 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include "opc.h"
+
+// Heartbeats let a supervisor see which stage of a program has stalled.
+// Each stage beats whenever it makes progress; the table lives in POSIX
+// shared memory, so that tools outside the process can watch it too.
+#define HEARTBEAT_MAX 24
+
+typedef struct {
+  char name[16];
+  volatile u32 beats;
+  volatile u32 stalls;  // times the supervisor found this stage stalled
+  volatile u32 restarts;  // times the supervisor restarted it
+  volatile u32 stalled;  // nonzero while the supervisor finds it stalled
+  volatile double last_restart;  // when the supervisor last restarted it
+  volatile double last_beat;  // CLOCK_MONOTONIC seconds
+} heartbeat;
+
+typedef struct {
+  u32 pid;
+  u32 count;
+  heartbeat beats[HEARTBEAT_MAX];
+} heartbeat_table;
+
+// Creates the table in shared memory under shm_name (like "/play"), or in
+// private memory if that fails.
+heartbeat_table* heartbeat_open(char* shm_name);
+
+// Adds a stage to the table.  Returns NULL if the table is full.
+heartbeat* heartbeat_add(heartbeat_table* t, char* name);
+
+// Records progress; cheap enough to call on every item.
+void heartbeat_beat(heartbeat* h);
+
+// Seconds since the last beat.
+double heartbeat_age(heartbeat* h);
+
+#endif
@@ -0,0 +1,80 @@
+#include "hist.h"
+
+// Prometheus gets every fourth bucket boundary between these, in us; a few
+// dozen buckets per histogram instead of hundreds.
+#define HIST_EXPORT_MIN 32
+#define HIST_EXPORT_MAX (1 << 21)
+#define HIST_EXPORT_STEP 4
+
+static int hist_index(u32 us) {
+  int octave;
+  if (us < HIST_SUB_BUCKETS) {
+    return us;
+  }
+  if (us >= 1u << (HIST_OCTAVES + 4)) {
+    return HIST_BUCKETS - 1;
+  }
+  octave = 31 - __builtin_clz(us) - 4;  // 16 <= us >> octave < 32
+  return HIST_SUB_BUCKETS*(octave + 1) + (us >> octave) - HIST_SUB_BUCKETS;
+}
+
+// The lowest value, in us, above the values counted in bucket i.
+static u32 hist_limit(int i) {
+  int octave;
+  if (i < HIST_SUB_BUCKETS) {
+    return i + 1;
+  }
+  octave = i/HIST_SUB_BUCKETS - 1;
+  return (u32) (i%HIST_SUB_BUCKETS + HIST_SUB_BUCKETS + 1) << octave;
+}
+
+void hist_record(hist* h, double seconds) {
+  u32 us = seconds <= 0 ? 0 : seconds >= 4000 ? 4000000000u : seconds*1e6;
+  __atomic_fetch_add(&h->counts[hist_index(us)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+}
+
+u32 hist_count(hist* h) {
+  u32 count = 0;
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    count += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+  }
+  return count;
+}
+
+double hist_quantile(hist* h, double q) {
+  u32 counts[HIST_BUCKETS], count = 0, seen = 0;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    count += counts[i];
+  }
+  if (!count) return 0;
+  for (i = 0; i < HIST_BUCKETS - 1; i++) {
+    seen += counts[i];
+    if (seen >= q*count) break;
+  }
+  return hist_limit(i)/1e6;
+}
+
+void hist_write_prometheus(hist* h, FILE* fp, char* name, char* labels) {
+  char* comma = labels[0] ? "," : "";
+  u32 count = 0, limit;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    count += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    limit = hist_limit(i);
+    if (limit >= HIST_EXPORT_MIN && limit <= HIST_EXPORT_MAX &&
+        (limit >> (31 - __builtin_clz(limit) - 4)) % HIST_EXPORT_STEP == 0) {
+      fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %u\n",
+              name, labels, comma, limit/1e6, count);
+    }
+  }
+  fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, comma, count);
+  fprintf(fp, "%s_sum{%s} %g\n", name, labels,
+          __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED)/1e6);
+  fprintf(fp, "%s_count{%s} %u\n", name, labels, count);
+}
@@ -0,0 +1,35 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+
+#include "opc.h"
+
+// A latency histogram in the style of HdrHistogram.  Values are counted in
+// microseconds, in buckets 1/16 as wide as their magnitude, so each value
+// is known to within about 6%, from 1 us to about 18 minutes.  Recording
+// is lock-free and safe from any number of threads.
+#define HIST_SUB_BUCKETS 16
+#define HIST_OCTAVES 26
+#define HIST_BUCKETS (HIST_SUB_BUCKETS*(HIST_OCTAVES + 1))
+
+typedef struct {
+  u32 counts[HIST_BUCKETS];
+  unsigned long long sum_us;
+} hist;
+
+// Counts one value, in seconds.
+void hist_record(hist* h, double seconds);
+
+// The number of values counted.
+u32 hist_count(hist* h);
+
+// The value in seconds below which a fraction q of the values fall, or 0 if
+// nothing has been counted.
+double hist_quantile(hist* h, double q);
+
+// Writes the _bucket, _sum and _count lines of a Prometheus histogram named
+// name, with labels (like "stage=\"analysis\"", or "") on every line.
+void hist_write_prometheus(hist* h, FILE* fp, char* name, char* labels);
+
+#endif
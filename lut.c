@@ -0,0 +1,71 @@
+#include <math.h>
+
+#include "lut.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void lut_update(lut* l, float gamma, float brightness,
+                float white_r, float white_g, float white_b) {
+  float scale[3];
+  double v;
+  int i, c;
+
+  if (l->built && l->gamma == gamma && l->brightness == brightness &&
+      l->white[0] == white_r && l->white[1] == white_g &&
+      l->white[2] == white_b) {
+    return;
+  }
+  l->gamma = gamma;
+  l->brightness = brightness;
+  l->white[0] = white_r;
+  l->white[1] = white_g;
+  l->white[2] = white_b;
+  for (c = 0; c < 3; c++) {
+    scale[c] = 255*256*brightness*l->white[c];
+  }
+  for (i = 0; i < LUT_SIZE; i++) {
+    v = pow(i/(double) (LUT_SIZE - 1), gamma);
+    for (c = 0; c < 3; c++) {
+      l->table[i][c] = v*scale[c] + 0.5;
+    }
+  }
+  l->built = 1;
+}
+
+void lut_apply(lut* l, u16* levels, u8* error, u8* out, int count) {
+  u16* table = &l->table[0][0];
+  u16 x[16] __attribute__((aligned(16)));
+  int i = 0, j, c = 0;
+
+#ifdef __SSE2__
+  __m128i lo, hi, low_bits = _mm_set1_epi16(0xff), zero = _mm_setzero_si128();
+  __m128i e;
+  for (; i + 16 <= count; i += 16) {
+    // Look up 16 values, then add the carried error and split off the new
+    // error, 8 lanes at a time.  x + error never exceeds 65280 + 255.
+    for (j = 0; j < 16; j++) {
+      x[j] = table[levels[i + j]*3 + c];
+      c = c == 2 ? 0 : c + 1;
+    }
+    e = _mm_loadu_si128((__m128i*) (error + i));
+    lo = _mm_add_epi16(_mm_load_si128((__m128i*) x),
+                       _mm_unpacklo_epi8(e, zero));
+    hi = _mm_add_epi16(_mm_load_si128((__m128i*) (x + 8)),
+                       _mm_unpackhi_epi8(e, zero));
+    _mm_storeu_si128((__m128i*) (error + i),
+                     _mm_packus_epi16(_mm_and_si128(lo, low_bits),
+                                      _mm_and_si128(hi, low_bits)));
+    _mm_storeu_si128((__m128i*) (out + i),
+                     _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                      _mm_srli_epi16(hi, 8)));
+  }
+#endif
+  for (; i < count; i++) {
+    x[0] = table[levels[i]*3 + c] + error[i];
+    c = c == 2 ? 0 : c + 1;
+    out[i] = x[0] >> 8;
+    error[i] = x[0] & 0xff;
+  }
+}
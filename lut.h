@@ -0,0 +1,29 @@
+#ifndef LUT_H
+#define LUT_H
+
+#include "opc.h"
+
+// The final output stage: per-channel lookup tables from 16-bit linear
+// levels to 8-bit LED values, folding in gamma, white balance and the
+// brightness limit, with temporal dithering of the lost low bits.
+
+#define LUT_SIZE 65536
+
+typedef struct {
+  // table[level][channel] is the output for a level, in 8.8 fixed point.
+  u16 table[LUT_SIZE][3];
+  float gamma, brightness, white[3];  // what the table was built for
+  int built;
+} lut;
+
+// Rebuilds the table unless it was already built for these settings.
+// brightness and the white balance factors range from 0 to 1.
+void lut_update(lut* l, float gamma, float brightness,
+                float white_r, float white_g, float white_b);
+
+// Maps count levels (interleaved r, g, b) to 8-bit values.  error holds the
+// fractional part left over from each value's previous frame and is updated,
+// so that over time each output averages out to its exact level.
+void lut_apply(lut* l, u16* levels, u8* error, u8* out, int count);
+
+#endif
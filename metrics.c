@@ -0,0 +1,118 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+typedef struct {
+  char* name;
+  char* help;
+  hist* h;
+  char* labels;
+} metric;
+
+static metric metrics[METRICS_MAX];
+static int metrics_count = 0;
+static int metrics_sock = -1;
+static pthread_t metrics_thread;
+
+void metrics_add(char* name, char* help, hist* h, char* labels) {
+  metric* m;
+  if (metrics_count >= METRICS_MAX) return;
+  m = &metrics[metrics_count++];
+  m->name = name;
+  m->help = help;
+  m->h = h;
+  m->labels = labels;
+}
+
+static void metrics_write(FILE* fp) {
+  int i;
+  for (i = 0; i < metrics_count; i++) {
+    if (i == 0 || strcmp(metrics[i].name, metrics[i - 1].name)) {
+      fprintf(fp, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+      fprintf(fp, "# TYPE %s histogram\n", metrics[i].name);
+    }
+    hist_write_prometheus(metrics[i].h, fp, metrics[i].name,
+                          metrics[i].labels);
+  }
+}
+
+// Answers every request with the metrics; one client at a time, with a
+// timeout so that a stuck client can't hold up the next scrape for long.
+static void* metrics_main(void* arg) {
+  struct timeval timeout = { 1, 0 };
+  char request[1024];
+  FILE* fp;
+  int client;
+
+  while (1) {
+    client = accept(metrics_sock, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (read(client, request, sizeof(request)) > 0 &&
+        (fp = fdopen(client, "w"))) {
+      fprintf(fp, "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Connection: close\r\n\r\n");
+      metrics_write(fp);
+      fclose(fp);
+    } else {
+      close(client);
+    }
+  }
+  return NULL;
+}
+
+int metrics_start(char* address) {
+  struct addrinfo hints, *result;
+  char host[100], *colon;
+  int one = 1;
+
+  strncpy(host, address, sizeof(host) - 1);
+  host[sizeof(host) - 1] = 0;
+  if (!(colon = strchr(host, ':'))) {
+    fprintf(stderr, "Metrics: no port in %s\n", address);
+    return 0;
+  }
+  *colon = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &result)) {
+    fprintf(stderr, "Metrics: bad address: %s\n", address);
+    return 0;
+  }
+
+  // Scrapers that go away must not kill us with SIGPIPE.
+  signal(SIGPIPE, SIG_IGN);
+
+  metrics_sock = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(metrics_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (metrics_sock < 0 ||
+      bind(metrics_sock, result->ai_addr, result->ai_addrlen) < 0 ||
+      listen(metrics_sock, 4) < 0) {
+    fprintf(stderr, "Metrics: can't listen on %s: %s\n",
+            address, strerror(errno));
+    freeaddrinfo(result);
+    if (metrics_sock >= 0) close(metrics_sock);
+    metrics_sock = -1;
+    return 0;
+  }
+  freeaddrinfo(result);
+  pthread_create(&metrics_thread, NULL, metrics_main, NULL);
+  return 1;
+}
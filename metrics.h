@@ -0,0 +1,18 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "hist.h"
+
+// Serves histograms in the Prometheus text format over HTTP, from a thread
+// of its own, so that they can be scraped and graphed.
+
+#define METRICS_MAX 32
+
+// Exports a histogram as part of the metric family name, with labels like
+// "stage=\"analysis\"".  All histograms in a family must be added together.
+void metrics_add(char* name, char* help, hist* h, char* labels);
+
+// Starts serving on address ("<host>:<port>").  Returns 0 on failure.
+int metrics_start(char* address);
+
+#endif
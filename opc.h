@@ -0,0 +1,45 @@
+#ifndef OPC_H
+#define OPC_H
+
+// Open Pixel Control client: sends pixel frames to an OPC server over TCP.
+// See http://openpixelcontrol.org/ for the protocol.
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef signed char s8;
+typedef short s16;
+typedef int s32;
+
+typedef struct {
+  u8 r, g, b;
+} pixel;
+
+typedef s8 opc_sink;
+
+#define OPC_DEFAULT_PORT 7890
+#define OPC_MAX_SINKS 64
+
+// The largest frame that fits in one OPC message.
+#define OPC_MAX_PIXELS (65535/3)
+
+// Creates a sink for "host" or "host:port".  Returns -1 if the address
+// can't be resolved; otherwise connecting happens in the background.
+opc_sink opc_new_sink(char* hostport);
+
+// Sends a frame if the sink is connected and has finished sending the last
+// one; otherwise drops it.  Never blocks: connecting and reconnecting (with
+// exponential backoff) proceed across calls.  Returns 1 if the frame was
+// queued in the socket, 0 if it was dropped.
+u8 opc_put_pixels(opc_sink sink, u8 channel, u16 count, pixel* pixels);
+
+// Drops a connection that has stopped accepting data, and reconnects with
+// the usual backoff.  A sink that is still connecting or waiting to retry
+// is left alone.
+void opc_reconnect(opc_sink sink);
+
+// Waits up to timeout_ms for the rest of a partially written frame to go
+// out.  Returns 1 if nothing remains to be sent.
+u8 opc_flush(opc_sink sink, int timeout_ms);
+
+#endif
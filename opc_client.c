@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "opc.h"
+#include "clock.h"
+
+#define OPC_HEADER_BYTES 4
+#define OPC_BACKOFF_MIN 0.1  // seconds
+#define OPC_BACKOFF_MAX 5.0
+#define OPC_CONNECT_TIMEOUT 2.0
+#define OPC_STABLE_TIME 2.0  // connected this long, the backoff starts over
+
+typedef enum {
+  OPC_DISCONNECTED, OPC_CONNECTING, OPC_CONNECTED
+} opc_state;
+
+typedef struct {
+  struct sockaddr_in address;
+  char hostport[80];
+  int sock;
+  opc_state state;
+  double next_attempt;  // earliest time to try connecting again
+  double connect_started;
+  double connected_at;
+  double backoff;
+
+  // The unsent remainder of the last message after a partial write.
+  u8* tail;
+  int tail_start, tail_length;
+} opc_sink_info;
+
+static opc_sink_info opc_sinks[OPC_MAX_SINKS];
+static int opc_num_sinks = 0;
+
+opc_sink opc_new_sink(char* hostport) {
+  opc_sink_info* info;
+  struct addrinfo hints, *result;
+  char host[64];
+  char* colon;
+  int port = OPC_DEFAULT_PORT;
+
+  if (opc_num_sinks >= OPC_MAX_SINKS) {
+    fprintf(stderr, "OPC: no more sinks available\n");
+    return -1;
+  }
+  strncpy(host, hostport, sizeof(host) - 1);
+  host[sizeof(host) - 1] = 0;
+  if (colon = strchr(host, ':')) {
+    *colon = 0;
+    port = atoi(colon + 1);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host[0] ? host : "localhost", NULL, &hints, &result)) {
+    fprintf(stderr, "OPC: host not found: %s\n", host);
+    return -1;
+  }
+
+  // Peers that go away must not kill us with SIGPIPE.
+  signal(SIGPIPE, SIG_IGN);
+
+  info = &opc_sinks[opc_num_sinks];
+  memset(info, 0, sizeof(opc_sink_info));
+  memcpy(&info->address, result->ai_addr, sizeof(struct sockaddr_in));
+  info->address.sin_port = htons(port);
+  freeaddrinfo(result);
+  snprintf(info->hostport, sizeof(info->hostport), "%s:%d", host, port);
+  info->sock = -1;
+  info->state = OPC_DISCONNECTED;
+  info->backoff = OPC_BACKOFF_MIN;
+  info->tail = malloc(OPC_HEADER_BYTES + OPC_MAX_PIXELS*3);
+  return opc_num_sinks++;
+}
+
+static opc_sink_info* opc_get_sink(opc_sink sink) {
+  return (sink >= 0 && sink < opc_num_sinks) ? &opc_sinks[sink] : NULL;
+}
+
+// Drops the connection and schedules the next attempt.
+static void opc_fail(opc_sink_info* info, char* what, int error) {
+  if (info->state == OPC_CONNECTED || info->backoff == OPC_BACKOFF_MIN) {
+    fprintf(stderr, "OPC: %s %s: %s; retrying in %.1f s\n",
+            what, info->hostport, strerror(error), info->backoff);
+  }
+  if (info->sock >= 0) {
+    close(info->sock);
+  }
+  info->sock = -1;
+  info->state = OPC_DISCONNECTED;
+  info->tail_length = 0;
+  info->next_attempt = get_time() + info->backoff;
+  info->backoff *= 2;
+  if (info->backoff > OPC_BACKOFF_MAX) {
+    info->backoff = OPC_BACKOFF_MAX;
+  }
+}
+
+static void opc_connected(opc_sink_info* info) {
+  info->state = OPC_CONNECTED;
+  info->connected_at = get_time();
+  if (info->backoff != OPC_BACKOFF_MIN) {
+    fprintf(stderr, "OPC: connected to %s\n", info->hostport);
+  }
+}
+
+static void opc_connect(opc_sink_info* info) {
+  int one = 1;
+
+  info->sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (info->sock < 0) {
+    opc_fail(info, "can't create socket for", errno);
+    return;
+  }
+  fcntl(info->sock, F_SETFL, fcntl(info->sock, F_GETFL) | O_NONBLOCK);
+  setsockopt(info->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(info->sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  info->connect_started = get_time();
+  if (connect(info->sock, (struct sockaddr*) &info->address,
+              sizeof(info->address)) == 0) {
+    opc_connected(info);
+  } else if (errno == EINPROGRESS) {
+    info->state = OPC_CONNECTING;
+  } else {
+    opc_fail(info, "can't connect to", errno);
+  }
+}
+
+// Writes as much of the pending tail as the socket will take right now.
+static void opc_write_tail(opc_sink_info* info) {
+  ssize_t n;
+  while (info->tail_length > 0) {
+    n = write(info->sock, info->tail + info->tail_start, info->tail_length);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        opc_fail(info, "lost connection to", errno);
+      }
+      return;
+    }
+    info->tail_start += n;
+    info->tail_length -= n;
+  }
+}
+
+// Moves the connection along without blocking; returns 1 if the sink can
+// take a new message now.
+static int opc_ready(opc_sink_info* info) {
+  struct pollfd pfd;
+  int error = 0;
+  socklen_t error_size = sizeof(error);
+
+  if (info->state == OPC_DISCONNECTED) {
+    if (get_time() < info->next_attempt) {
+      return 0;
+    }
+    opc_connect(info);
+  }
+  if (info->state == OPC_CONNECTING) {
+    pfd.fd = info->sock;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, 0) <= 0) {
+      if (get_time() - info->connect_started > OPC_CONNECT_TIMEOUT) {
+        opc_fail(info, "timed out connecting to", ETIMEDOUT);
+      }
+      return 0;
+    }
+    getsockopt(info->sock, SOL_SOCKET, SO_ERROR, &error, &error_size);
+    if (error) {
+      opc_fail(info, "can't connect to", error);
+      return 0;
+    }
+    opc_connected(info);
+  }
+
+  // A peer that accepts and then drops each connection (like a controller
+  // that is rebooting) must keep backing off, so only a connection that
+  // has stayed up for a while resets the backoff.
+  if (info->state == OPC_CONNECTED && info->backoff != OPC_BACKOFF_MIN &&
+      get_time() - info->connected_at >= OPC_STABLE_TIME) {
+    info->backoff = OPC_BACKOFF_MIN;
+  }
+  opc_write_tail(info);
+  return info->state == OPC_CONNECTED && info->tail_length == 0;
+}
+
+void opc_reconnect(opc_sink sink) {
+  opc_sink_info* info = opc_get_sink(sink);
+  if (!info || info->state != OPC_CONNECTED) return;
+  opc_fail(info, "no progress sending to", ETIMEDOUT);
+}
+
+u8 opc_put_pixels(opc_sink sink, u8 channel, u16 count, pixel* pixels) {
+  opc_sink_info* info = opc_get_sink(sink);
+  u8 header[OPC_HEADER_BYTES];
+  struct iovec iov[2];
+  ssize_t total, n;
+  int length;
+
+  if (!info || !opc_ready(info)) {
+    return 0;
+  }
+  if (count > OPC_MAX_PIXELS) {
+    count = OPC_MAX_PIXELS;
+  }
+  length = count*3;
+  header[0] = channel;
+  header[1] = 0;  // command: set pixel colours
+  header[2] = length >> 8;
+  header[3] = length & 0xff;
+  iov[0].iov_base = header;
+  iov[0].iov_len = OPC_HEADER_BYTES;
+  iov[1].iov_base = pixels;
+  iov[1].iov_len = length;
+  total = OPC_HEADER_BYTES + length;
+
+  do {
+    n = writev(info->sock, iov, 2);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      opc_fail(info, "lost connection to", errno);
+      return 0;
+    }
+    return 0;  // nothing went out, so the stream is still intact
+  }
+
+  // Keep whatever didn't fit so that the next message starts cleanly.
+  if (n < total) {
+    if (n < OPC_HEADER_BYTES) {
+      memcpy(info->tail, header + n, OPC_HEADER_BYTES - n);
+      memcpy(info->tail + OPC_HEADER_BYTES - n, pixels, length);
+    } else {
+      memcpy(info->tail, (u8*) pixels + (n - OPC_HEADER_BYTES), total - n);
+    }
+    info->tail_start = 0;
+    info->tail_length = total - n;
+  }
+  return 1;
+}
+
+u8 opc_flush(opc_sink sink, int timeout_ms) {
+  opc_sink_info* info = opc_get_sink(sink);
+  struct pollfd pfd;
+  double deadline = get_time() + timeout_ms/1000.0;
+  int wait_ms;
+
+  if (!info) {
+    return 1;
+  }
+  while (info->state == OPC_CONNECTED && info->tail_length > 0) {
+    wait_ms = (deadline - get_time())*1000;
+    if (wait_ms <= 0) {
+      break;
+    }
+    pfd.fd = info->sock;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, wait_ms) > 0) {
+      opc_write_tail(info);
+    }
+  }
+  return info->tail_length == 0;
+}
@@ -0,0 +1,226 @@
+// Tests the OPC client against a stand-in server on the loopback interface:
+// a refused connection, partial writes under backpressure, a server that
+// restarts, and a server that drops every connection it accepts.  Run with
+// "make test"; exits nonzero if anything fails.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "opc.h"
+#include "clock.h"
+
+#define TEST_PIXELS 20000  // 60 kB frames, to fill the socket buffers
+
+int test_failures = 0;
+pixel test_frame[TEST_PIXELS];
+
+void test_check(int ok, char* what) {
+  printf("%s - %s\n", ok ? "ok" : "FAILED", what);
+  test_failures += !ok;
+}
+
+// Opens a nonblocking listener on port (0 for any free port), with a small
+// receive buffer so that backpressure comes soon.  Returns the socket.
+int test_listen(int port) {
+  struct sockaddr_in address;
+  int one = 1, size = 4096;
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr*) &address, sizeof(address)) ||
+      listen(sock, 4)) {
+    perror("test_listen");
+    exit(1);
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  return sock;
+}
+
+int test_port(int sock) {
+  struct sockaddr_in address;
+  socklen_t size = sizeof(address);
+  getsockname(sock, (struct sockaddr*) &address, &size);
+  return ntohs(address.sin_port);
+}
+
+opc_sink test_sink(int port) {
+  char hostport[40];
+  sprintf(hostport, "127.0.0.1:%d", port);
+  return opc_new_sink(hostport);
+}
+
+// Fills the frame with one value, so that a message that arrives torn or
+// out of step shows up as a mix of values.
+u8 test_put(opc_sink sink, u8 value) {
+  memset(test_frame, value, sizeof(test_frame));
+  return opc_put_pixels(sink, 1, TEST_PIXELS, test_frame);
+}
+
+// A message being read from a connection.
+typedef struct {
+  u8 message[4 + TEST_PIXELS*3];
+  int length;
+} test_reader;
+
+// Reads OPC messages from a connection and checks that each one is whole:
+// a header for TEST_PIXELS pixels, then bytes that all have one value.
+// Returns the number of messages read, or -1 if the stream is corrupt.
+int test_read(test_reader* r, int sock) {
+  int count = 0, n, i, total = sizeof(r->message);
+  while ((n = read(sock, r->message + r->length, total - r->length)) > 0) {
+    r->length += n;
+    if (r->length < total) continue;
+    if (r->message[0] != 1 || r->message[1] != 0 ||
+        (r->message[2] << 8 | r->message[3]) != TEST_PIXELS*3) {
+      return -1;
+    }
+    for (i = 5; i < total; i++) {
+      if (r->message[i] != r->message[4]) return -1;
+    }
+    r->length = 0;
+    count++;
+  }
+  return count;
+}
+
+int test_accept(int listener, double timeout) {
+  double deadline = get_time() + timeout;
+  int sock;
+  while ((sock = accept(listener, NULL, NULL)) < 0 &&
+         get_time() < deadline) {
+    usleep(1000);
+  }
+  if (sock >= 0) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  }
+  return sock;
+}
+
+void test_refused() {
+  int listener = test_listen(0), port = test_port(listener), i;
+  opc_sink sink;
+  double start, slowest = 0;
+  u8 sent = 0;
+
+  close(listener);  // nothing listens on port now
+  sink = test_sink(port);
+  for (i = 0; i < 100; i++) {
+    start = get_time();
+    sent |= test_put(sink, i);
+    slowest = get_time() - start > slowest ? get_time() - start : slowest;
+    usleep(1000);
+  }
+  test_check(!sent, "refused: every frame is dropped");
+  test_check(slowest < 0.01, "refused: opc_put_pixels never blocks");
+}
+
+void test_backpressure() {
+  static test_reader reader;
+  int listener = test_listen(0), sock, i, received = 0, n;
+  opc_sink sink = test_sink(test_port(listener));
+  int queued = 0, dropped = 0;
+  double start, slowest = 0;
+
+  test_put(sink, 0);  // starts connecting
+  sock = test_accept(listener, 1);
+  test_check(sock >= 0, "backpressure: connected");
+
+  // The server doesn't read, so the socket fills and frames go out in
+  // pieces, and then are dropped.
+  for (i = 1; i <= 50; i++) {
+    start = get_time();
+    if (test_put(sink, i)) queued++; else dropped++;
+    slowest = get_time() - start > slowest ? get_time() - start : slowest;
+  }
+  test_check(queued > 0 && dropped > 0,
+             "backpressure: frames are dropped while the socket is full");
+  test_check(slowest < 0.01, "backpressure: opc_put_pixels never blocks");
+
+  // Once the server reads again, the partial frame is finished and every
+  // message arrives whole.
+  for (i = 0; i < 1000 && received >= 0; i++) {
+    opc_flush(sink, 1);
+    test_put(sink, 100 + i % 100);
+    n = test_read(&reader, sock);
+    received = n < 0 ? -1 : received + n;
+  }
+  test_check(received > queued, "backpressure: messages arrive whole");
+  close(sock);
+  close(listener);
+}
+
+void test_restart() {
+  static test_reader reader;
+  int listener = test_listen(0), port = test_port(listener), sock, i;
+  opc_sink sink = test_sink(port);
+  int received = 0;
+  double deadline;
+
+  test_put(sink, 0);
+  sock = test_accept(listener, 1);
+  test_check(sock >= 0, "restart: connected");
+  close(sock);
+  close(listener);
+
+  // While the server is down, the client notices and keeps dropping.
+  for (i = 0; i < 50; i++) {
+    test_put(sink, i);
+    usleep(2000);
+  }
+
+  // After the restart, the client reconnects on its own and sends whole
+  // messages again.
+  listener = test_listen(port);
+  deadline = get_time() + 5;
+  sock = -1;
+  while (get_time() < deadline && received <= 0) {
+    test_put(sink, 7);
+    if (sock < 0) {
+      sock = test_accept(listener, 0.01);
+    } else {
+      received = test_read(&reader, sock);
+    }
+  }
+  test_check(received > 0, "restart: reconnects and delivers frames");
+  close(sock);
+  close(listener);
+}
+
+void test_drop_on_accept() {
+  int listener = test_listen(0), sock, accepts = 0;
+  opc_sink sink = test_sink(test_port(listener));
+  double deadline = get_time() + 1.5;
+
+  // A controller that is rebooting accepts and then drops each connection;
+  // with backoff of 0.1, 0.2, 0.4, 0.8 s that is about five tries, where a
+  // client that resets its backoff on connecting would try fifteen times.
+  while (get_time() < deadline) {
+    test_put(sink, 0);
+    if ((sock = accept(listener, NULL, NULL)) >= 0) {
+      accepts++;
+      close(sock);
+    }
+    usleep(1000);
+  }
+  test_check(accepts > 1 && accepts <= 6,
+             "drop on accept: the client backs off");
+  close(listener);
+}
+
+int main(int argc, char** argv) {
+  test_refused();
+  test_backpressure();
+  test_restart();
+  test_drop_on_accept();
+  return test_failures ? 1 : 0;
+}
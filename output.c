@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+#include "clock.h"
+#include "trace.h"
+
+// Sends the parts of an Art-Net slice whose universes have changed since
+// the last frame sent, or all of it if full is set.
+static void output_put_artnet(output* out, output_slice* s, int full) {
+  int offset = s->start - out->first;
+  pixel* p = out->sending_pixels + offset;
+  pixel* last = out->sent_pixels + offset;
+  int k, n;
+
+  for (k = 0; k < s->count; k += ARTNET_UNIVERSE_PIXELS) {
+    n = s->count - k;
+    n = n < ARTNET_UNIVERSE_PIXELS ? n : ARTNET_UNIVERSE_PIXELS;
+    if (full || memcmp(p + k, last + k, n*sizeof(pixel))) {
+      artnet_put_pixels(out->sink, s->channel + k/ARTNET_UNIVERSE_PIXELS,
+                        n, p + k);
+    }
+  }
+}
+
+// Sends sending_pixels unless it's identical to the last frame sent and the
+// keepalive interval hasn't run out.  Returns 0 if the frame was skipped.
+static int output_send(output* out) {
+  int size = (out->last - out->first)*sizeof(pixel);
+  double now = get_time();
+  int full = !out->sent_valid ||
+      now - out->last_full_time >= out->keepalive_interval;
+  int delivered = 1;
+  output_slice* s;
+  int i;
+
+  if (!full && !memcmp(out->sending_pixels, out->sent_pixels, size)) {
+    return 0;
+  }
+  for (i = 0, s = out->slices; i < out->num_slices; i++, s++) {
+    if (out->transport == OUTPUT_ARTNET) {
+      output_put_artnet(out, s, full);
+    } else {
+      delivered &= opc_put_pixels(out->sink, s->channel, s->count,
+                                  out->sending_pixels + (s->start - out->first));
+      opc_flush(out->sink, 100);  // finish a partial write, if any
+    }
+  }
+  if (out->transport == OUTPUT_ARTNET) {
+    artnet_flush(out->sink);
+  }
+
+  // A frame the sink dropped must go out again even if nothing changes.
+  memcpy(out->sent_pixels, out->sending_pixels, size);
+  out->sent_valid = delivered;
+  if (full) {
+    out->last_full_time = now;
+  }
+  return 1;
+}
+
+static void* output_main(void* arg) {
+  output* out = arg;
+  pixel* p;
+  double start, elapsed;
+  int sent;
+  u32 frame;
+
+  trace_thread("output");
+  pthread_mutex_lock(&out->mutex);
+  while (1) {
+    while (!out->pending && !out->quit) {
+      pthread_cond_wait(&out->cond, &out->mutex);
+    }
+    if (out->quit) break;
+    p = out->sending_pixels;
+    out->sending_pixels = out->pending_pixels;
+    out->pending_pixels = p;
+    out->pending = 0;
+    frame = out->pending_frame;
+    pthread_mutex_unlock(&out->mutex);
+
+    if (out->reconnect) {
+      out->reconnect = 0;
+      if (out->transport == OUTPUT_OPC) {
+        opc_reconnect(out->sink);
+      }
+      out->sent_valid = 0;
+    }
+    trace_begin("send", frame);
+    start = get_time();
+    sent = output_send(out);
+    elapsed = get_time() - start;
+    trace_end("send", frame);
+    if (!sent || out->sent_valid) {
+      heartbeat_beat(out->heartbeat);
+    }
+    if (sent) {
+      out->last_send_time = elapsed;
+      if (elapsed > out->max_send_time) {
+        out->max_send_time = elapsed;
+      }
+      hist_record(&out->send_hist, elapsed);
+    }
+
+    pthread_mutex_lock(&out->mutex);
+    if (sent) {
+      out->frames_sent++;
+    } else {
+      out->frames_skipped++;
+    }
+  }
+  pthread_mutex_unlock(&out->mutex);
+  return NULL;
+}
+
+void output_init(output* out, output_transport transport, s8 sink) {
+  memset(out, 0, sizeof(output));
+  out->transport = transport;
+  out->sink = sink;
+  out->keepalive_interval = 1;
+}
+
+// Works out the part of the stream covered by the slices.
+static void output_update_range(output* out) {
+  output_slice* s;
+  int i;
+  for (i = 0, s = out->slices; i < out->num_slices; i++, s++) {
+    if (i == 0 || s->start < out->first) out->first = s->start;
+    if (i == 0 || s->start + s->count > out->last) {
+      out->last = s->start + s->count;
+    }
+  }
+}
+
+void output_add_slice(output* out, u16 channel, int start, int count) {
+  output_slice* s;
+  if (out->num_slices >= OUTPUT_MAX_SLICES) return;
+  if (out->transport == OUTPUT_OPC && count > OPC_MAX_PIXELS) {
+    count = OPC_MAX_PIXELS;
+  }
+  s = &out->slices[out->num_slices++];
+  s->channel = channel;
+  s->start = start;
+  s->count = count;
+  output_update_range(out);
+}
+
+void output_resize_slice(output* out, int i, int count) {
+  if (i < 0 || i >= out->num_slices) return;
+  if (out->transport == OUTPUT_OPC && count > OPC_MAX_PIXELS) {
+    count = OPC_MAX_PIXELS;
+  }
+  out->slices[i].count = count;
+  output_update_range(out);
+}
+
+void output_start(output* out) {
+  int size = (out->last - out->first)*sizeof(pixel);
+  out->quit = 0;
+  out->pending = 0;
+  out->sent_valid = 0;
+  out->pending_pixels = calloc(1, size ? size : 1);
+  out->sending_pixels = calloc(1, size ? size : 1);
+  out->sent_pixels = calloc(1, size ? size : 1);
+  pthread_mutex_init(&out->mutex, NULL);
+  pthread_cond_init(&out->cond, NULL);
+  pthread_create(&out->thread, NULL, output_main, out);
+}
+
+void output_stop(output* out) {
+  pthread_mutex_lock(&out->mutex);
+  out->quit = 1;
+  pthread_cond_signal(&out->cond);
+  pthread_mutex_unlock(&out->mutex);
+  pthread_join(out->thread, NULL);
+  pthread_mutex_destroy(&out->mutex);
+  pthread_cond_destroy(&out->cond);
+  if (out->pending) {
+    out->frames_dropped++;  // so that the backlog stays right on a restart
+  }
+  free(out->pending_pixels);
+  free(out->sending_pixels);
+  free(out->sent_pixels);
+}
+
+void output_put_pixels(output* out, u32 frame, int count, pixel* pixels) {
+  int n = (count < out->last ? count : out->last) - out->first;
+  if (n < 0) n = 0;
+  pthread_mutex_lock(&out->mutex);
+  if (out->pending) {
+    out->frames_dropped++;
+  }
+  memcpy(out->pending_pixels, pixels + out->first, n*sizeof(pixel));
+  memset(out->pending_pixels + n, 0,
+         (out->last - out->first - n)*sizeof(pixel));
+  out->pending_frame = frame;
+  out->pending = 1;
+  out->frames_queued++;
+  pthread_cond_signal(&out->cond);
+  pthread_mutex_unlock(&out->mutex);
+}
+
+void output_reconnect(output* out) {
+  out->reconnect = 1;
+}
+
+int output_backlog(output* out) {
+  return out->frames_queued - out->frames_sent - out->frames_dropped -
+      out->frames_skipped;
+}
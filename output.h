@@ -0,0 +1,85 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <pthread.h>
+
+#include "opc.h"
+#include "artnet.h"
+#include "heartbeat.h"
+#include "hist.h"
+
+#define OUTPUT_MAX_SLICES 32
+
+// How an output reaches its controller.
+typedef enum {
+  OUTPUT_OPC,  // OPC over TCP; slice channels are OPC channels
+  OUTPUT_ARTNET  // Art-Net over UDP; slice channels are starting universes
+} output_transport;
+
+// A slice sends count pixels of the output stream, starting at start, to one
+// channel.
+typedef struct {
+  u16 channel;
+  int start, count;
+} output_slice;
+
+// An output sends its slices of each frame to one sink on its own thread,
+// so that a slow or unreachable LED controller never stalls the caller or
+// any other output.  It holds at most one pending frame: a new frame
+// replaces a pending one that hasn't been picked up yet, which is counted
+// as dropped.
+//
+// Frames identical to the last one sent are skipped, except that the whole
+// frame is resent every keepalive_interval seconds.  Art-Net outputs only
+// send the universes that have changed.
+typedef struct {
+  output_transport transport;
+  s8 sink;  // an opc_sink or an artnet_sink
+  int num_slices;
+  output_slice slices[OUTPUT_MAX_SLICES];
+  int first, last;  // the part of the stream covered by the slices
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  volatile int quit;
+  int pending;  // nonzero while pending_pixels holds an unsent frame
+  pixel* pending_pixels;
+  u32 pending_frame;  // the id of the depth frame in pending_pixels
+  pixel* sending_pixels;
+  pixel* sent_pixels;  // the last frame sent
+  int sent_valid;  // zero if the sink may not have received sent_pixels
+  double last_full_time;
+  volatile double keepalive_interval;  // seconds; 0 sends every frame
+
+  // Statistics, updated by the output thread; read them without locking.
+  volatile u32 frames_queued, frames_sent, frames_dropped, frames_skipped;
+  volatile double last_send_time, max_send_time;  // seconds
+  hist send_hist;  // of the seconds taken by each frame sent
+  heartbeat* heartbeat;  // beats for each frame delivered or skipped
+  volatile int reconnect;  // set by output_reconnect()
+} output;
+
+void output_init(output* out, output_transport transport, s8 sink);
+void output_add_slice(output* out, u16 channel, int start, int count);
+void output_start(output* out);
+void output_stop(output* out);
+
+// Changes the number of pixels in slice i, for when the output stream
+// changes length.  Only while the output is stopped; output_start() then
+// picks up the new size.
+void output_resize_slice(output* out, int i, int count);
+
+// Copies this output's part of the count-pixel stream into the mailbox and
+// returns immediately.  Slices beyond the end of the stream are sent black.
+// frame is the id of the depth frame the pixels were made from, for tracing.
+void output_put_pixels(output* out, u32 frame, int count, pixel* pixels);
+
+// Asks the output thread to drop and reopen its connection before the next
+// frame, if it is connected but has stopped accepting data.
+void output_reconnect(output* out);
+
+// Frames queued but not yet sent (including one being sent).
+int output_backlog(output* out);
+
+#endif
@@ -46,6 +46,7 @@
 #include <math.h>
 
 #include "opc.h"
+#include "color.h"
 
 opc_sink sink;
 int rows, cols;
@@ -256,69 +257,6 @@ void *gl_threadfunc(void *arg) {
   return NULL;
 }
 
-uint16_t t_gamma[2048];
-
-void set_rgb_by_depth(uint16_t depth, uint8_t* rgb) {
-  int pval = t_gamma[depth];
-  int lb = pval & 0xff;
-  switch (pval>>8) {
-    case 0:
-      rgb[0] = 255;
-      rgb[1] = 255-lb;
-      rgb[2] = 255-lb;
-      break;
-    case 1:
-      rgb[0] = 255;
-      rgb[1] = lb;
-      rgb[2] = 0;
-      break;
-    case 2:
-      rgb[0] = 255-lb;
-      rgb[1] = 255;
-      rgb[2] = 0;
-      break;
-    case 3:
-      rgb[0] = 0;
-      rgb[1] = 255;
-      rgb[2] = lb;
-      break;
-    case 4:
-      rgb[0] = 0;
-      rgb[1] = 255-lb;
-      rgb[2] = 255;
-      break;
-    case 5:
-      rgb[0] = 0;
-      rgb[1] = 0;
-      rgb[2] = 255-lb;
-      break;
-    default:
-      rgb[0] = 0;
-      rgb[1] = 0;
-      rgb[2] = 0;
-      break;
-  }
-}
-
-pixel hue_pixel(float hue) {
-  pixel p;
-  int k = (hue - floor(hue)) * 255 * 3;
-  if (k < 255) {
-    p.r = 255 - k;
-    p.g = k;
-    p.b = 0;
-  } else if (k < 510) {
-    p.g = 255 - (k - 255);
-    p.b = k - 255;
-    p.r = 0;
-  } else {
-    p.b = 255 - (k - 510);
-    p.r = k - 510;
-    p.g = 0;
-  }
-  return p;
-}
-
 void advance_particles() {
   int i;
   particle* p;
@@ -479,12 +417,7 @@ int main(int argc, char **argv) {
   depth_mid = (uint8_t*)malloc(640*480*3);
   depth_front = (uint8_t*)malloc(640*480*3);
 
-  int i;
-  for (i=0; i<2048; i++) {
-    float v = i/2048.0;
-    v = powf(v, 3)* 6;
-    t_gamma[i] = v*6*256;
-  }
+  color_init();
 
   g_argc = argc;
   g_argv = argv;
@@ -3,9 +3,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
 
+#define GL_GLEXT_PROTOTYPES
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
@@ -14,36 +21,154 @@
 
 #include "libfreenect.h"
 #include "opc.h"
+#include "color.h"
+#include "output.h"
+#include "lut.h"
+#include "preview.h"
+#include "queue.h"
+#include "runtime.h"
+#include "hist.h"
+#include "metrics.h"
+#include "trace.h"
+#include "heartbeat.h"
+#include "checkpoint.h"
+#include "filewatch.h"
+#include "scene.h"
+#include "clock.h"
 
-#define SWAP(type, a, b) { type c = a; a = b; b = c; }
 #define depth_to_mm(d) (1000/(-0.00307*d + 3.33))
 
-// These variables are shared between both threads.
-pthread_mutex_t depth_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t depth_ready_cond = PTHREAD_COND_INITIALIZER;
-int depth_ready = 0;
-u16 depth1[640*480], depth2[640*480];
-
 // "f_" variables belong to the Freenect thread.
 pthread_t f_thread;
 volatile int f_should_quit = 0;
 freenect_context* f_context;
 freenect_device* f_device;
-u16* f_depth = depth1;
 volatile int f_paused = 0;
+volatile int f_restart = 0;  // set to close and re-open the device
+volatile double f_start_time = 0;  // when the device was last started
+heartbeat* f_heartbeat;  // beats for every frame, even while paused
+scene f_scene;  // played instead of the Kinect if given on the command line
+
+// "c_" variables belong to the convert thread, which converts captured
+// frames to millimetres and rotates them by cam_rot.
+pthread_t c_thread;
+volatile int c_should_quit = 0;
+
+// "a_" variables belong to the analysis thread, which finds the column
+// altitudes and emits particles.
+pthread_t a_thread;
+volatile int a_should_quit = 0;
+
+// "s_" variables belong to the save thread.
+pthread_t s_thread;
+volatile int s_should_quit = 0;
+
+// "w_" variables belong to the watchdog thread, which restarts stalled
+// stages.
+pthread_t w_thread;
+volatile int w_should_quit = 0;
 
 // "g_" variables belong to the GLUT thread
 volatile int g_should_quit = 0;
-u16* g_depth = depth2;
 int g_window;
-GLuint g_texture;
-opc_sink g_sink;
+preview_texture g_depth_texture;
+GLuint g_program;
+u32 g_preview_frame = 0;  // id of the depth frame on display
+
+// "r_" variables belong to the render thread, which advances, draws and
+// sends the particles at out_hz.
+pthread_t r_thread;
+volatile int r_should_quit = 0;
+
+// Each output sends its slices of the output stream to one OPC server on its
+// own thread; see output.c.  The topology comes from outputs.txt, or else is
+// the whole stream on channel 1 of the server given on the command line.
+// Addresses starting with "artnet:" are sent as Art-Net over UDP.
+#define MAX_OUTPUTS 16
+output outputs[MAX_OUTPUTS];
+char output_addresses[MAX_OUTPUTS][100];
+char output_labels[MAX_OUTPUTS][120];  // for metrics
+int num_outputs = 0;
 
 typedef struct {
   u16 altitude, depth_mm;
   double depth_m;
 } col_record;
 
+// These variables are shared between threads.
+
+// Depth frames travel through a pipeline of stages, each on its own thread
+// and connected by queues: capture (the Freenect thread) -> convert ->
+// analyze -> preview (the GLUT thread), and then back to capture.  Analysis
+// passes the particles it emits on to the render thread, which feeds the
+// outputs.  No stage ever waits for room downstream: a frame or emission
+// that doesn't fit is dropped and counted, so a stall in the preview or
+// the render thread can't hold up capture or analysis.
+typedef struct {
+  u16 raw[640*480];  // as captured
+  u16 depth[640*480];  // in mm, rotated by cam_rot
+  u32 id;  // frame number, for tracing
+  double time;  // capture time
+  double captured;  // get_time() when it was captured
+  double queued_time;  // get_time() when it was queued for its current stage
+  col_record col_records[25];
+} depth_frame;
+
+#define NUM_DEPTH_FRAMES 6
+depth_frame depth_frames[NUM_DEPTH_FRAMES];
+queue free_frames;  // from the preview, for capture to fill
+queue skipped_frames;  // from analysis, for frames the preview didn't want
+queue convert_queue, analyze_queue, preview_queue;
+queue emission_queue;
+
+// Set by the preview when it's due to draw a frame; analysis then passes it
+// the next one and clears this.
+volatile int preview_wanted = 0;
+
+// Per-stage counters, for the report shown by pressing 'i'.  Each is only
+// written by its own stage.
+typedef struct {
+  char* name;
+  queue* in;  // the queue the stage takes its items from, if any
+  u32 count;  // items handled
+  u32 dropped;  // items dropped for lack of room, besides in->full
+  double wait, max_wait;  // seconds the last and slowest item was queued
+  double busy, max_busy;  // seconds spent on the last and slowest item
+  hist busy_hist;  // of the seconds spent on each item
+  heartbeat* heartbeat;  // beats for each item, if the stage is watched
+} stage;
+
+stage capture_stage = { "capture", NULL };
+stage convert_stage = { "convert", &convert_queue };
+stage analyze_stage = { "analyze", &analyze_queue };
+stage render_stage = { "render", &emission_queue };
+stage preview_stage = { "preview", &preview_queue };
+
+// Latency histograms beyond the stages' own, exported with them by the
+// metrics server.
+hist emission_hist;  // emitting particles, within analysis
+hist capture_to_analysis_hist;  // from capture until analysis starts
+hist end_to_end_hist;  // from capture until its particles are sent out
+
+#define METRICS_ADDRESS "127.0.0.1:9464"  // unless $METRICS_ADDRESS is set
+
+// Every stage beats a heartbeat in shared memory as it makes progress.  The
+// watchdog checks every WATCH_INTERVAL that each stage with work to do has
+// beaten within its timeout.  A stalled stage that can be restarted on its
+// own (the Kinect, an output's connection) is restarted, at most once per
+// WATCH_RESTART_INTERVAL.  /tmp/heartbeat, which the watchdog scripts
+// watch, is only touched while nothing is stalled, so a stall that can't be
+// fixed here still ends in a restart of the whole program.
+#define HEARTBEAT_SHM "/play-heartbeats"
+#define WATCH_INTERVAL 0.02
+#define WATCH_TIMEOUT 0.1
+#define WATCH_GLUT_TIMEOUT 1.0
+#define WATCH_START_TIMEOUT 2.0  // for the Kinect to start sending frames
+#define WATCH_RESTART_INTERVAL 1.0
+#define WATCH_TOUCH_INTERVAL 1.0  // for /tmp/heartbeat
+heartbeat_table* heartbeats;
+heartbeat* g_heartbeat;
+
 typedef struct {
   char* name;
   char* format;
@@ -53,7 +178,10 @@ typedef struct {
   int modulo;
 } param;
 
-param g_params[100] = {
+// The GLUT thread owns the params and edits them here.  Every change is
+// published as a new snapshot, which the other threads pick up.
+#define MAX_PARAMS 100
+param g_params[MAX_PARAMS] = {
   { "min_depth", "%4.2f m", 0.5, 0.1, 0.1, 9.0, 0 },
   { "max_depth", "%4.2f m", 2.7, 0.1, 0.1, 9.0, 0 },
   { "x_width", "%3.0f", 640, 1, 10, 640, 0 },
@@ -74,73 +202,369 @@ param g_params[100] = {
   { "val_decay", "%5.3f", 0.950, 0.01, 0, 1, 0},
   { "max_val", "%3.0f", 255, 10, 0, 255, 0 },
 
+  { "keepalive", "%3.1f s", 1.0, 0.1, 0, 10, 0 },
+  { "out_hz", "%3.0f Hz", 60, 10, 30, 120, 0 },
+
+  { "led_gamma", "%3.1f", 1.0, 0.1, 1.0, 3.0, 0 },
+  { "wb_r", "%4.2f", 1.0, 0.02, 0, 1, 0 },
+  { "wb_g", "%4.2f", 1.0, 0.02, 0, 1, 0 },
+  { "wb_b", "%4.2f", 1.0, 0.02, 0, 1, 0 },
+
+  { "preview", "%3.0f Hz", PREVIEW_DEFAULT_HZ, 5, 0, 60, 0 },
+
   { NULL, NULL, 0, 0 }
 };
-#define min_depth g_params[0].value
-#define max_depth g_params[1].value
-#define x_width g_params[2].value
-#define y_height g_params[3].value
-
-#define c_flip g_params[4].value
-#define r_shift g_params[5].value
-#define cam_rot g_params[6].value
-#define y_shift g_params[7].value
-
-#define emit_min_v g_params[8].value
-#define emit_velf g_params[9].value
-#define friction g_params[10].value
-#define depth_step g_params[11].value
-
-#define hue_cycles g_params[12].value
-#define emit_valf g_params[13].value
-#define val_decay g_params[14].value
-#define max_val g_params[15].value
+#define min_depth params.values[0]
+#define max_depth params.values[1]
+#define x_width params.values[2]
+#define y_height params.values[3]
+
+#define c_flip params.values[4]
+#define r_shift params.values[5]
+#define cam_rot params.values[6]
+#define y_shift params.values[7]
+
+#define emit_min_v params.values[8]
+#define emit_velf params.values[9]
+#define friction params.values[10]
+#define depth_step params.values[11]
+
+#define hue_cycles params.values[12]
+#define emit_valf params.values[13]
+#define val_decay params.values[14]
+#define max_val params.values[15]
+
+#define keepalive params.values[16]
+#define out_hz params.values[17]
+
+#define led_gamma params.values[18]
+#define wb_r params.values[19]
+#define wb_g params.values[20]
+#define wb_b params.values[21]
+
+#define preview params.values[22]
 
 int g_num_params = 0;
+
+// A published set of param values.  Snapshots are never modified while
+// current; once PARAM_SNAPSHOTS newer ones have been published, the oldest
+// slot is reused, with its generation set to 0 while it is rewritten.
+typedef struct {
+  u32 generation;
+  float values[MAX_PARAMS];
+} param_snapshot;
+
+#define PARAM_SNAPSHOTS 16
+param_snapshot param_snapshots[PARAM_SNAPSHOTS];
+param_snapshot* latest_params = &param_snapshots[0];
+
+// Each thread reads params through its own copy of a snapshot, which it
+// refreshes with params_update() once per frame, so that params never
+// change in the middle of a frame.
+__thread param_snapshot params;
+
+// Values derived from params, in the form the per-frame loops use them.
+// Like params, each thread keeps its own copy; derived_update() rebuilds it
+// only when the thread's params have changed.
+typedef struct {
+  u32 generation;  // of the params these were derived from
+  int min_x, max_x, min_y, max_y;  // the region of interest
+  int col_start[25], col_end[25];  // x range of each column; ends may overlap
+  int discard;  // samples to drop at each end of a column's sorted samples
+  s32 min_mm, max_mm;  // depths in mm strictly between these are in range
+  float ramp_min_mm, ramp_max_mm;  // ends of the preview's colour ramp
+} derived_state;
+
+__thread derived_state derived;
+
+// current.params is written by the save thread, SAVE_DELAY seconds after the
+// params stop changing.
+#define SAVE_DELAY 0.5
+pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t save_cond = PTHREAD_COND_INITIALIZER;
+double save_time = 0;  // when to save, or 0 if there are no changes to save
+struct stat s_saved;  // the current.params last written by the save thread
 int g_selected_param = 0;
 int rows = 50, cols = 25;
 
 int pixel_map[50][25];
 
+// The preview shader.  The depth frame is uploaded as raw millimetres;
+// the fragment shader colourizes it on a ramp from white at min_depth through
+// red, yellow, green, cyan and blue to black at max_depth, dims everything
+// outside the region of interest, and overlays each column's altitude.
+const char* g_vertex_shader =
+    "varying vec2 xy;\n"
+    "void main() {\n"
+    "  xy = gl_MultiTexCoord0.xy*vec2(640.0, 480.0);\n"
+    "  gl_Position = ftransform();\n"
+    "}\n";
+
+const char* g_fragment_shader =
+    "uniform sampler2D depth;\n"
+    "uniform float min_mm, max_mm;\n"
+    "uniform vec4 roi;  // min_x, max_x, min_y, max_y\n"
+    "uniform float altitudes[25];\n"
+    "varying vec2 xy;\n"
+    "void main() {\n"
+    "  vec2 p = floor(xy);\n"
+    "  float mm = floor(texture2D(depth, (p + 0.5)/vec2(640.0, 480.0)).r\n"
+    "                  *65535.0 + 0.5);\n"
+    "  float v = floor((clamp(mm, min_mm, max_mm) - min_mm)*1024.0\n"
+    "                  /(max_mm - min_mm));\n"
+    "  float hi = floor(v/256.0), lo = (v - hi*256.0)/255.0;\n"
+    "  vec3 color = v == 0.0 ? vec3(1.0) : v >= 1024.0 ? vec3(0.0) :\n"
+    "      hi == 0.0 ? vec3(1.0, lo, 0.0) : hi == 1.0 ? vec3(1.0 - lo, 1.0, 0.0) :\n"
+    "      hi == 2.0 ? vec3(0.0, 1.0, lo) : vec3(0.0, 1.0 - lo, 1.0);\n"
+    "  if (p.x < roi.x || p.x >= roi.y || p.y < roi.z || p.y >= roi.w) {\n"
+    "    color = floor(color*255.0/4.0)/255.0;\n"
+    "  }\n"
+    "  if (p.x >= roi.x && p.x < roi.y) {\n"
+    "    // Column starts are truncated, so a pixel can also be the last of\n"
+    "    // the previous column; it gets both columns' marks, in order.\n"
+    "    float x = p.x - roi.x, w = roi.y - roi.x;\n"
+    "    int c = int(floor(x*25.0/w + 0.0005));\n"
+    "    int last_c = int(min(ceil((x + 1.0)*25.0/w - 0.0005), 25.0)) - 1;\n"
+    "    for (; c <= last_c; c++) {\n"
+    "      float y = 479.0 - altitudes[c];\n"
+    "      if (p.y == y) color = vec3(1.0);\n"
+    "      if (abs(p.y - y) == 1.0) color = vec3(0.0);\n"
+    "    }\n"
+    "  }\n"
+    "  gl_FragColor = vec4(color, 1.0);\n"
+    "}\n";
+
 // Pixel adjustments.
 int g_num_pixel_ranges = 0;
 struct {
   int start, stop;
 } g_pixel_ranges[100];
 
+// Reads the pixel adjustments from ranges.txt and the pixel layout from
+// map.txt.  Called at startup, and then only by the render thread.
+void load_layout() {
+  FILE* fp;
+  int r, c;
+
+  fp = fopen("ranges.txt", "r");
+  if (fp) {
+    g_num_pixel_ranges = 0;
+    while (g_num_pixel_ranges < 100 &&
+           fscanf(fp, "%d %d\n",
+                  &(g_pixel_ranges[g_num_pixel_ranges].start),
+                  &(g_pixel_ranges[g_num_pixel_ranges].stop)) == 2) {
+      g_num_pixel_ranges++;
+    }
+    fclose(fp);
+  }
+
+  fp = fopen("map.txt", "r");
+  if (fp) {
+    for (r = 0; r < rows; r++) {
+      for (c = 0; c < cols; c++) {
+        fscanf(fp, "%d", &(pixel_map[r][c]));
+      }
+      fscanf(fp, "\n");
+    }
+    fclose(fp);
+  }
+}
+
+// The renderers draw into a logical grid of rows x cols pixels, plus one
+// black pixel at GRID_BLACK.  r_out_map is the compiled output layout:
+// output pixel i is grid[r_out_map[i]], which folds in pixel_map, c_flip,
+// r_shift and the ranges from ranges.txt.
+#define GRID_PIXELS (50*25)
+#define GRID_BLACK GRID_PIXELS
+#define MAX_OUT_PIXELS 65536
+
+int r_out_map[MAX_OUT_PIXELS];
+int r_out_count = 0;
+int r_out_map_stale = 1;
+volatile int r_reload_layout = 0;  // set to re-read map.txt and ranges.txt
+int r_out_count_sent;  // the length of stream the outputs were set up for
+int r_default_output = -1;  // the output covering the whole stream, if any
+u32 r_out_map_generation;  // of the params the map was built from
+
 // Particles.
 #define MAX_PARTICLES 2000
 
 typedef struct {
   float c, r, v;
   float hue, sat, val;
+  float last_r, last_val;  // state before the most recent simulation step
 } particle;
 
+// The particles belong to the render thread; other threads only read
+// num_particles, for display.
 int num_particles = 0;
 particle particles[MAX_PARTICLES];
 
+// The particles emitted for one depth frame, on their way to the render
+// thread.
+typedef struct {
+  int count;
+  particle particles[25];
+  u32 frame;  // id of the depth frame
+  double time;  // capture time of the frame
+  double captured;  // get_time() when the frame was captured
+  double wall_time;  // get_time() when analysis finished with it
+} emission;
+
+// The state a restarted process resumes from, in shared memory.  Each
+// section is written by the thread that owns it, every time it changes,
+// and read back at startup if it's no older than WARM_MAX_AGE.  A rebuild
+// changes WARM_VERSION, and so starts cold.
+#define WARM_SHM "/play-warm"
+#define WARM_VERSION "play " __DATE__ " " __TIME__
+#define WARM_MAX_AGE 10.0
+
+typedef struct {
+  checkpoint_section params_section;  // written by the GLUT thread
+  float params[MAX_PARAMS];
+  checkpoint_section columns_section;  // by the analysis thread
+  col_record col_records[25];
+  checkpoint_section particles_section;  // by the render thread
+  int num_particles;
+  particle particles[MAX_PARTICLES];
+} warm_state;
+
+warm_state* warm = NULL;
+
+// Simulation clock.  The particle simulation advances in fixed steps of
+// SIM_DT seconds of capture time, independent of the output rate; rendering
+// interpolates between the last two steps by r_sim_alpha.
+#define SIM_HZ 30
+#define SIM_DT (1.0/SIM_HZ)
+#define MAX_SIM_STEPS 8
+#define MAX_EXTRAPOLATION 0.1  // seconds past the last depth frame
+
+double r_frame_time = -1, r_frame_wall_time = 0;  // of the last emission
+u32 r_frame_id = 0;
+double r_sim_time = -1;
+double r_sim_accum = 0;
+float r_sim_alpha = 0;
+float r_invitation_t = 0;
+double r_quiet_time = 0;
+
+// Linear channel levels of the logical grid (0 to 65535), and the output
+// LUT with the low bits it carries between frames (temporal dithering).
+u16 r_levels[GRID_PIXELS][3];
+u8 r_dither[GRID_PIXELS][3];
+lut r_lut;
+
 // Pure functions.
-u8 clamp_byte(float val) {
+float clamp_level(float val) {
   return (val < 0) ? 0 : (val > 255) ? 255 : val;
 }
 
-pixel hue_pixel(float hue) {
-  pixel p;
-  int k = (hue - floor(hue)) * 255 * 3;
-  if (k < 255) {
-    p.r = 255 - k;
-    p.g = k;
-    p.b = 0;
-  } else if (k < 510) {
-    p.g = 255 - (k - 255);
-    p.b = k - 255;
-    p.r = 0;
-  } else {
-    p.b = 255 - (k - 510);
-    p.r = k - 510;
-    p.g = 0;
+// Refreshes this thread's params from the latest snapshot.  Returns 1 if
+// they have changed.
+int params_update() {
+  param_snapshot* s;
+  u32 generation;
+  for (;;) {
+    s = __atomic_load_n(&latest_params, __ATOMIC_ACQUIRE);
+    generation = __atomic_load_n(&s->generation, __ATOMIC_ACQUIRE);
+    if (generation == params.generation) return 0;
+    if (generation == 0) continue;  // being reused; look again
+    memcpy(params.values, s->values, sizeof(params.values));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->generation, __ATOMIC_RELAXED) == generation) {
+      params.generation = generation;
+      return 1;
+    }
+  }
+}
+
+// Returns the deepest depth in mm that is no deeper than depth_m metres,
+// exactly as the comparison mm/1000.0 <= depth_m would decide it.
+s32 deepest_mm_within(float depth_m) {
+  s32 mm = floor(depth_m*1000.0);
+  if (mm < -1) mm = -1;
+  if (mm > 65535) mm = 65535;
+  while (mm < 65535 && (mm + 1)/1000.0 <= depth_m) mm++;
+  while (mm >= 0 && mm/1000.0 > depth_m) mm--;
+  return mm;
+}
+
+// Rebuilds this thread's derived values if its params have changed.
+void derived_update() {
+  int c;
+
+  if (derived.generation == params.generation) return;
+
+  derived.min_x = (640 - x_width) / 2;
+  derived.max_x = derived.min_x + x_width;
+  derived.min_y = (480 - y_height) / 2;
+  derived.max_y = derived.min_y + y_height;
+
+  // Columns start at the truncated and end at the rounded-up boundary, so
+  // a pixel straddling two columns is sampled by both.
+  for (c = 0; c < 25; c++) {
+    derived.col_start[c] = derived.min_x + (x_width*c/25);
+    derived.col_end[c] = ceil(derived.min_x + (x_width*(c + 1)/25));
+  }
+  derived.discard = (x_width/25)*0.1;
+  derived.discard = (derived.discard < 1) ? 1 : derived.discard;
+
+  // Out of range is d <= min_depth or d >= max_depth, with d = mm/1000.0.
+  derived.min_mm = deepest_mm_within(min_depth);
+  derived.max_mm = deepest_mm_within(max_depth);
+  if (derived.max_mm >= 0 && derived.max_mm/1000.0 < max_depth) {
+    derived.max_mm++;
+  }
+
+  derived.ramp_min_mm = min_depth*1000;
+  derived.ramp_max_mm = max_depth*1000;
+  if (derived.ramp_min_mm >= derived.ramp_max_mm) {
+    derived.ramp_min_mm = derived.ramp_max_mm - 1;
+  }
+
+  derived.generation = params.generation;
+}
+
+// Writes a snapshot of the params to a file, replacing it atomically.
+int save_params(char* name, param_snapshot* snapshot) {
+  char temp_name[200];
+  FILE* fp;
+  int p;
+
+  snprintf(temp_name, sizeof(temp_name), "%s.tmp", name);
+  fp = fopen(temp_name, "w");
+  if (!fp) {
+    return 0;
   }
-  return p;
+  for (p = 0; p < MAX_PARAMS && g_params[p].name; p++) {
+    if (g_params[p].name[0]) {
+      fprintf(fp, "%s %.6f\n", g_params[p].name, snapshot->values[p]);
+    }
+  }
+  fflush(fp);
+  fsync(fileno(fp));
+  fclose(fp);
+  return rename(temp_name, name) == 0;
+}
+
+// Records that a stage has picked up an item queued at queued_time, and
+// returns the time it started on it.
+double stage_start(stage* s, double queued_time) {
+  double now = get_time();
+  s->wait = now - queued_time;
+  s->max_wait = s->wait > s->max_wait ? s->wait : s->max_wait;
+  return now;
+}
+
+// Records that a stage has finished an item it started at start_time, and
+// returns the time it finished.
+double stage_finish(stage* s, double start_time) {
+  double now = get_time();
+  s->busy = now - start_time;
+  s->max_busy = s->busy > s->max_busy ? s->busy : s->max_busy;
+  s->count++;
+  hist_record(&s->busy_hist, s->busy);
+  heartbeat_beat(s->heartbeat);
+  return now;
 }
 
 // GLUT thread functions.
@@ -158,19 +582,82 @@ void g_show_params() {
   fprintf(stderr, "\n\n");
 }
 
-int g_save_params(char* name) {
-  FILE* fp = fopen(name, "w");
-  int p;
-  if (!fp) {
-    return 0;
+void g_show_stages() {
+  stage* stages[] = {
+    &capture_stage, &convert_stage, &analyze_stage, &render_stage,
+    &preview_stage
+  };
+  stage* s;
+  output* out;
+  int i;
+
+  fprintf(stderr, "\n\n%-8s %8s %8s %18s %18s %17s\n",
+          "stage", "count", "dropped", "wait ms (max)", "busy ms (max)",
+          "p50 ms   p99 ms");
+  for (i = 0; i < 5; i++) {
+    s = stages[i];
+    fprintf(stderr, "%-8s %8u %8u %8.1f (%7.1f) %8.1f (%7.1f) %8.1f %8.1f\n",
+            s->name, s->count, s->dropped + (s->in ? s->in->full : 0),
+            s->wait*1000, s->max_wait*1000, s->busy*1000, s->max_busy*1000,
+            hist_quantile(&s->busy_hist, 0.5)*1000,
+            hist_quantile(&s->busy_hist, 0.99)*1000);
+  }
+  for (i = 0, out = outputs; i < num_outputs; i++, out++) {
+    fprintf(stderr, "output %d %8u %8u %8s %8s %8.1f (%7.1f) %8.1f %8.1f\n",
+            i, out->frames_sent, out->frames_dropped, "", "",
+            out->last_send_time*1000, out->max_send_time*1000,
+            hist_quantile(&out->send_hist, 0.5)*1000,
+            hist_quantile(&out->send_hist, 0.99)*1000);
+  }
+  fprintf(stderr, "%-64s %8.1f %8.1f\n", "end to end",
+          hist_quantile(&end_to_end_hist, 0.5)*1000,
+          hist_quantile(&end_to_end_hist, 0.99)*1000);
+  fprintf(stderr, "\n");
+}
+
+// Writes the recent trace events of all threads to trace-<time>.json.
+void g_write_trace() {
+  char filename[40];
+  int count;
+
+  snprintf(filename, sizeof(filename), "trace-%ld.json", (long) time(NULL));
+  count = trace_write(filename);
+  if (count < 0) {
+    fprintf(stderr, "\nCould not write %s.\n", filename);
+  } else {
+    fprintf(stderr, "\nWrote %d events to %s.\n", count, filename);
   }
+}
+
+// Publishes the params as a new snapshot.
+void g_publish_params() {
+  static u32 generation = 0;
+  param_snapshot* s = &param_snapshots[++generation % PARAM_SNAPSHOTS];
+  int p;
+
+  __atomic_store_n(&s->generation, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
   for (p = 0; p < g_num_params; p++) {
-    if (g_params[p].name && g_params[p].name[0]) {
-      fprintf(fp, "%s %.6f\n", g_params[p].name, g_params[p].value);
+    s->values[p] = g_params[p].value;
+  }
+  __atomic_store_n(&s->generation, generation, __ATOMIC_RELEASE);
+  __atomic_store_n(&latest_params, s, __ATOMIC_RELEASE);
+  params_update();
+  if (warm) {
+    checkpoint_begin(&warm->params_section);
+    for (p = 0; p < g_num_params; p++) {
+      warm->params[p] = g_params[p].value;
     }
+    checkpoint_end(&warm->params_section);
   }
-  fclose(fp);
-  return 1;
+}
+
+// Asks the save thread to save current.params once the params settle.
+void g_request_save() {
+  pthread_mutex_lock(&save_mutex);
+  save_time = get_time() + SAVE_DELAY;
+  pthread_cond_signal(&save_cond);
+  pthread_mutex_unlock(&save_mutex);
 }
 
 int g_load_params(char* name) {
@@ -193,9 +680,58 @@ int g_load_params(char* name) {
   return 1;
 }
 
+// Files that are reloaded whenever they change.
+filewatch g_files;
+int g_map_file, g_ranges_file, g_params_file;
+
+// Returns 1 if current.params was last written by the save thread.
+int g_saved_params_unchanged() {
+  struct stat st;
+  int unchanged;
+  pthread_mutex_lock(&save_mutex);
+  unchanged = stat("current.params", &st) == 0 &&
+      st.st_ino == s_saved.st_ino && st.st_size == s_saved.st_size &&
+      st.st_mtime == s_saved.st_mtime;
+  pthread_mutex_unlock(&save_mutex);
+  return unchanged;
+}
+
+void g_check_files() {
+  int i;
+  while ((i = filewatch_poll(&g_files)) >= 0) {
+    if (i == g_map_file || i == g_ranges_file) {
+      r_reload_layout = 1;
+    }
+    if (i == g_params_file && !g_saved_params_unchanged() &&
+        g_load_params("current.params")) {
+      fprintf(stderr, "\nReloaded current.params.");
+      g_publish_params();
+      g_show_params();
+    }
+  }
+}
+
+void* r_main(void* arg);
+void* w_main(void* arg);
+
+GLuint g_compile_shader(GLenum type, const char* source) {
+  GLuint shader = glCreateShader(type);
+  GLint ok;
+  char log[1000];
+
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "Could not compile the preview shader:\n%s\n", log);
+    exit(1);
+  }
+  return shader;
+}
+
 void g_init(int width, int height) {
-  for (g_num_params = 0; g_params[g_num_params].name; g_num_params++);
-  g_load_params("current.params");
+  color_init();
 
   // Set GL options.
   glClearColor(0, 0, 0, 0);
@@ -217,73 +753,247 @@ void g_init(int width, int height) {
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
 
-  // Prepare a texture for displaying the frame.
-  glGenTextures(1, &g_texture);
-  glBindTexture(GL_TEXTURE_2D, g_texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  // Prepare a 16-bit texture for the depth frame.  Depths must not be
+  // interpolated, so the filtering is nearest-neighbour.
+  preview_texture_init(&g_depth_texture, 640, 480, GL_LUMINANCE16,
+                       GL_LUMINANCE, GL_UNSIGNED_SHORT, 2);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  // Build the preview shader.
+  g_program = glCreateProgram();
+  glAttachShader(g_program,
+                 g_compile_shader(GL_VERTEX_SHADER, g_vertex_shader));
+  glAttachShader(g_program,
+                 g_compile_shader(GL_FRAGMENT_SHADER, g_fragment_shader));
+  glLinkProgram(g_program);
+  glUseProgram(g_program);
+  glUniform1i(glGetUniformLocation(g_program, "depth"), 0);
+
+  // Watch the layout and params files.
+  filewatch_init(&g_files);
+  g_map_file = filewatch_add(&g_files, "map.txt");
+  g_ranges_file = filewatch_add(&g_files, "ranges.txt");
+  g_params_file = filewatch_add(&g_files, "current.params");
+
+  // Start rendering to the LEDs.
+  pthread_create(&r_thread, NULL, r_main, NULL);
+  runtime_apply("render", r_thread);
+  pthread_create(&w_thread, NULL, w_main, NULL);
+  runtime_apply("watchdog", w_thread);
+  runtime_apply("glut", pthread_self());
+  runtime_report(stderr);
 }
 
 void g_quit() {
+  int i;
+  w_should_quit = 1;
+  pthread_join(w_thread, NULL);
+  pthread_mutex_lock(&save_mutex);
+  s_should_quit = 1;
+  pthread_cond_signal(&save_cond);
+  pthread_mutex_unlock(&save_mutex);
+  pthread_join(s_thread, NULL);
   f_should_quit = 1;
   pthread_join(f_thread, NULL);
+  c_should_quit = 1;
+  pthread_join(c_thread, NULL);
+  a_should_quit = 1;
+  pthread_join(a_thread, NULL);
+  r_should_quit = 1;
+  pthread_join(r_thread, NULL);
+  for (i = 0; i < num_outputs; i++) {
+    output_stop(&outputs[i]);
+  }
   glutDestroyWindow(g_window);
   exit(0);
 }
 
-void g_draw_frame(pixel* frame, u16* depth, col_record* col_records) {
-  s32 i, d, v;
-  u8 hi, lo;
-  pixel p, black, white;
-  s32 min_mm = min_depth*1000;
-  s32 max_mm = max_depth*1000;
-  int min_x = (640 - x_width) / 2;
-  int max_x = min_x + x_width;
-  int min_y = (480 - y_height) / 2;
-  int max_y = min_y + y_height;
-  int c, x, y;
-  pixel frame_oob;
-
-#define set_pixel(p, nr, ng, nb) ((p).r = nr, (p).g = ng, (p).b = nb)
-
-  for (i = 0; i < 640*480; i++) {
-    d = depth[i] < min_mm ? min_mm : depth[i] > max_mm ? max_mm : depth[i];
-    v = (d - min_mm) * (256*4) / (max_mm - min_mm);
-    hi = v >> 8, lo = v & 0xff;
-    v == 0 ? set_pixel(p, 255, 255, 255) :
-        v == 256*4 ? set_pixel(p, 0, 0, 0) :
-        hi == 0 ? set_pixel(p, 255, lo, 0) :
-        hi == 1 ? set_pixel(p, 255 - lo, 255, 0) :
-        hi == 2 ? set_pixel(p, 0, 255, lo) :
-        hi == 3 ? set_pixel(p, 0, 255 - lo, 255) :
-        set_pixel(p, 128, 128, 128);
-    if (i/640 < min_y || i/640 >= max_y ||
-        (i%640) < min_x || (i%640) >= max_x) {
-      p.r /= 4;
-      p.g /= 4;
-      p.b /= 4;
-    }
-    frame[i] = p;
-  }
-
-#define frame_xy(x, y) (*(((x) >= 0 && (x) < 640 && (y) >= 0 && (y) < 480) ? &frame[(x) + (y)*640] : &frame_oob))
-
-  set_pixel(black, 0, 0, 0);
-  set_pixel(white, 255, 255, 255);
+// Sets the preview shader's uniforms for the current params and columns.
+void g_set_preview_uniforms(col_record* col_records) {
+  static u32 generation = 0;  // of the derived values last set
+  float altitudes[25];
+  int c;
+
+  derived_update();
+  if (generation != derived.generation) {
+    glUniform1f(glGetUniformLocation(g_program, "min_mm"),
+                derived.ramp_min_mm);
+    glUniform1f(glGetUniformLocation(g_program, "max_mm"),
+                derived.ramp_max_mm);
+    glUniform4f(glGetUniformLocation(g_program, "roi"), derived.min_x,
+                derived.max_x, derived.min_y, derived.max_y);
+    generation = derived.generation;
+  }
   for (c = 0; c < 25; c++) {
-    for (x = min_x + (x_width*c/25); x < min_x + (x_width*(c + 1)/25); x++) {
-      y = 479 - col_records[c].altitude;
-      frame_xy(x, y - 1) = black;
-      frame_xy(x, y) = white;
-      frame_xy(x, y + 1) = black;
+    altitudes[c] = col_records[c].altitude;
+  }
+  glUniform1fv(glGetUniformLocation(g_program, "altitudes"), 25, altitudes);
+}
+
+// Draws the current depth texture.
+void g_display() {
+  trace_begin("display", g_preview_frame);
+  glBegin(GL_TRIANGLE_FAN);
+  glColor4f(1, 1, 1, 1);
+  glTexCoord2f(0, 0);
+  glVertex3f(0, 0, 0);
+  glTexCoord2f(1, 0);
+  glVertex3f(640, 0, 0);
+  glTexCoord2f(1, 1);
+  glVertex3f(640, 480, 0);
+  glTexCoord2f(0, 1);
+  glVertex3f(0, 480, 0);
+  glEnd();
+  glutSwapBuffers();
+  trace_end("display", g_preview_frame);
+}
+
+// Runs on a GLUT timer, only when a preview frame is due; in between, the
+// GLUT thread sleeps until the next one or an input event.  The preview runs
+// at its own, lower rate, and not at all while hidden.
+void g_tick(int value) {
+  depth_frame* f;
+  double start, delay;
+
+  if (g_should_quit) {
+    g_quit();
+  }
+  if (trace_requested()) {
+    g_write_trace();
+  }
+
+  heartbeat_beat(g_heartbeat);
+  g_check_files();
+  params_update();
+  preview_hz = preview;
+  delay = preview_delay();
+  if (delay == 0) {
+    // Ask analysis for a frame, and check back shortly if it isn't here yet.
+    delay = PREVIEW_POLL_INTERVAL;
+    if (!queue_pop(&preview_queue, &f)) {
+      preview_wanted = 1;
+    } else {
+      // Upload the depth frame and let the shader draw it.
+      start = stage_start(&preview_stage, f->queued_time);
+      g_preview_frame = f->id;
+      trace_begin("preview", g_preview_frame);
+      g_set_preview_uniforms(f->col_records);
+      preview_texture_upload(&g_depth_texture, f->depth);
+      queue_push(&free_frames, &f);
+      trace_end("preview", g_preview_frame);
+      glutPostRedisplay();
+      preview_drawn();
+      stage_finish(&preview_stage, start);
+      delay = preview_delay();
+    }
+  }
+  glutTimerFunc(delay*1000, g_tick, 0);
+}
+
+void g_special(int key, int x, int y);
+
+void g_keypress(unsigned char key, int x, int y) {
+  char filename[10] = "0.params";
+  char* unshifted = "0123456789";
+  char* shifted = ")!@#$%^&*(";
+  char* p;
+  int i;
+
+  if (key == 27) {
+    g_should_quit = 1;
+  }
+  if (key == ' ') {
+    f_paused = !f_paused;
+  }
+  if (key == 'i') {
+    g_show_stages();
+  }
+  if (key == 't') {
+    g_write_trace();
+  }
+  if (p = strchr(unshifted, key)) {
+    i = p - unshifted;
+    filename[0] = unshifted[i];
+    if (g_load_params(filename)) {
+      fprintf(stderr, "\nLoaded %s.", filename);
+      g_publish_params();
+      g_show_params();
+    }
+    g_request_save();
+  }
+  if (p = strchr(shifted, key)) {
+    i = p - shifted;
+    filename[0] = unshifted[i];
+    if (save_params(filename, &params)) {
+      fprintf(stderr, "\nSaved %s.\n", filename);
     }
   }
+
+  if (key == '=' || key == '+') g_special(GLUT_KEY_UP, x, y);
+  if (key == '-' || key == '_') g_special(GLUT_KEY_DOWN, x, y);
+  if (key == '[') g_special(GLUT_KEY_LEFT, x, y);
+  if (key == ']') g_special(GLUT_KEY_RIGHT, x, y);
+}
+
+void g_special(int key, int x, int y) {
+  param* p = &g_params[g_selected_param];
+  int shift = glutGetModifiers() & GLUT_ACTIVE_SHIFT;
+  int ctrl = glutGetModifiers() & GLUT_ACTIVE_CTRL;
+  float mag = (shift ? 10 : 1) * (ctrl ? 0.1 : 1);
+  switch (key) {
+    case GLUT_KEY_UP:
+      p->value = p->modulo ? ((int) (p->value + p->delta)) % p->modulo :
+          p->value + p->delta*mag;
+      p->value = p->value > p->max ? p->max : p->value;
+      g_publish_params();
+      g_request_save();
+      break;
+    case GLUT_KEY_DOWN:
+      p->value = p->modulo ?
+          ((int) (p->value + p->modulo - p->delta)) % p->modulo :
+          p->value - p->delta*mag;
+      p->value = p->value < p->min ? p->min : p->value;
+      g_publish_params();
+      g_request_save();
+      break;
+    case GLUT_KEY_LEFT:
+      g_selected_param = (g_selected_param + g_num_params - 1) % g_num_params;
+      break;
+    case GLUT_KEY_RIGHT:
+      g_selected_param = (g_selected_param + 1) % g_num_params;
+      break;
+  }
+  g_show_params();
+}
+
+void* g_main(void* arg) {
+  int argc = 0;
+  char* argv = NULL;
+
+  trace_thread("glut");
+  glutInit(&argc, &argv);
+  glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA | GLUT_DEPTH);
+  glutInitWindowSize(640, 480);
+  glutInitWindowPosition(0, 0);
+  g_window = glutCreateWindow("depth camera");
+  glutDisplayFunc(g_display);
+  glutTimerFunc(0, g_tick, 0);
+  glutKeyboardFunc(g_keypress);
+  glutSpecialFunc(g_special);
+  glutWindowStatusFunc(preview_window_status);
+  g_init(640, 480);
+  glutMainLoop();
+  return NULL;
 }
 
-void g_advance_particles() {
+// Render thread functions.
+void r_advance_particles() {
   int i;
   particle* p;
   for (i = 0, p = particles; i < num_particles; i++, p++) {
+    p->last_r = p->r;
+    p->last_val = p->val;
     p->r += p->v;
     p->val *= val_decay;
     p->v += p->v > friction ? -friction : p->v < -friction ? friction : -p->v;
@@ -295,65 +1005,168 @@ void g_advance_particles() {
   }
 }
 
-static pixel dummy;
-#define pixel_rc(r, c) (pixels[pixel_map[r][c_flip ? 24 - c : c]])
-
-void g_put_pixel_ranges(pixel* pixels) {
-  pixel blacks[1250];
-  pixel outs[5000];
-  bzero(blacks, rows*cols*sizeof(pixel));
+void r_sim_step() {
+  r_advance_particles();
+  r_invitation_t += 0.01;
+}
 
-  if (g_num_pixel_ranges) {
-    int out = 0, start, stop, i;
-    for (i = 0; i < g_num_pixel_ranges; i++) {
-      start = g_pixel_ranges[i].start;
-      stop = g_pixel_ranges[i].stop;
-      if (start < stop) {
-        memcpy(outs + out, pixels + start, (stop - start)*sizeof(pixel));
-        out += stop - start;
-      } else {
-        memcpy(outs + out, blacks, (start - stop)*sizeof(pixel));
-        out += start - stop;
-      }
-    }
-    opc_put_pixels(g_sink, 1, out, outs);
-  } else {
-    opc_put_pixels(g_sink, 1, 1250, pixels);
+// Runs as many fixed simulation steps as fit into the capture time elapsed
+// since the last call, and sets r_sim_alpha for interpolated rendering.
+void r_sim_advance(double now) {
+  int steps = 0;
+  if (r_sim_time < 0 || now < r_sim_time - 1) {
+    r_sim_time = now;
+  }
+  if (now > r_sim_time) {
+    r_sim_accum += now - r_sim_time;
+    r_sim_time = now;
+  }
+  while (r_sim_accum >= SIM_DT && steps < MAX_SIM_STEPS) {
+    r_sim_step();
+    r_sim_accum -= SIM_DT;
+    steps++;
+  }
+  if (r_sim_accum >= SIM_DT) {
+    r_sim_accum = 0;  // too far behind; drop the backlog rather than spiral
   }
+  r_sim_alpha = r_sim_accum/SIM_DT;
 }
 
-void g_draw_particles() {
-  int i, r, c, shifted_r;
-  float d, v;
-  particle* p;
-  pixel* px;
-  pixel dpx;
-  pixel pixels[1250];
+// Recompiles r_out_map if the layout, c_flip or r_shift has changed.
+void r_update_out_map() {
+  int strip[GRID_PIXELS];
+  int r, c, sr, i, k, start, stop;
 
-  bzero(pixels, rows*cols*sizeof(pixel));
-  for (i = 0, p = particles; i < num_particles; i++, p++) {
-    for (r = 0; r < rows; r++) {
-      c = p->c;
-      d = p->r - r;
-      v = p->val/(1 + d*d);
-      dpx = hue_pixel(p->hue);
+  if (!r_out_map_stale && r_out_map_generation == params.generation) {
+    return;
+  }
+
+  // Find the logical pixel that lands on each position along the strip.
+  for (i = 0; i < GRID_PIXELS; i++) {
+    strip[i] = GRID_BLACK;
+  }
+  for (r = 0; r < rows; r++) {
+    sr = r + r_shift;
+    if (sr >= 0 && sr < rows) {
+      for (c = 0; c < cols; c++) {
+        i = pixel_map[sr][c_flip ? 24 - c : c];
+        if (i >= 0 && i < GRID_PIXELS) {
+          strip[i] = r*cols + c;
+        }
+      }
+    }
+  }
 
-      shifted_r = r + r_shift;
-      if (shifted_r >= 0 && shifted_r < 50) {
-        px = &pixel_rc(shifted_r, c);
-        px->r = clamp_byte(((float) px->r + v*dpx.r)*max_val/255.99);
-        px->g = clamp_byte(((float) px->g + v*dpx.g)*max_val/255.99);
-        px->b = clamp_byte(((float) px->b + v*dpx.b)*max_val/255.99);
+  // Lay the strip out in output order.
+  r_out_count = 0;
+  if (g_num_pixel_ranges) {
+    for (k = 0; k < g_num_pixel_ranges; k++) {
+      start = g_pixel_ranges[k].start;
+      stop = g_pixel_ranges[k].stop;
+      for (i = start; i < stop && r_out_count < MAX_OUT_PIXELS; i++) {
+        r_out_map[r_out_count++] =
+            (i >= 0 && i < GRID_PIXELS) ? strip[i] : GRID_BLACK;
+      }
+      for (i = stop; i < start && r_out_count < MAX_OUT_PIXELS; i++) {
+        r_out_map[r_out_count++] = GRID_BLACK;
       }
     }
+  } else {
+    for (i = 0; i < GRID_PIXELS; i++) {
+      r_out_map[r_out_count++] = strip[i];
+    }
   }
-  g_put_pixel_ranges(pixels);
+
+  r_out_map_stale = 0;
+  r_out_map_generation = params.generation;
 }
 
-void g_draw_invitation() {
-  static float t = 0;
-  pixel pixels[1250];
-  char play_image[30][25] = {
+// Follows a change in the length of the output stream, after map.txt or
+// ranges.txt is reloaded.  The output made from the command-line address
+// covers the whole stream, so it's restarted with its slice resized; the
+// slices from outputs.txt stay as they are until play is restarted.
+void r_check_out_count() {
+  output* out;
+
+  if (!num_outputs || r_out_count == r_out_count_sent) return;
+  if (r_default_output >= 0) {
+    out = &outputs[r_default_output];
+    output_stop(out);
+    output_resize_slice(out, 0, r_out_count);
+    output_start(out);
+    runtime_apply("output", out->thread);
+    fprintf(stderr, "\nResized output %d from %d to %d pixels.\n",
+            r_default_output, r_out_count_sent, r_out_count);
+  } else {
+    fprintf(stderr, "\nWarning: the output stream changed from %d to %d "
+            "pixels; outputs.txt is only read at startup.\n",
+            r_out_count_sent, r_out_count);
+  }
+  r_out_count_sent = r_out_count;
+}
+
+// Corrects r_levels to LED values and sends them out through the output map.
+pixel r_outs[MAX_OUT_PIXELS];  // the output stream of the last frame
+
+void r_put_pixels() {
+  pixel pixels[GRID_PIXELS + 1];
+  static u32 generation = 0;  // of the params the LUT was built from
+  int i;
+
+  if (generation != params.generation || r_out_map_stale) {
+    lut_update(&r_lut, led_gamma, max_val/255, wb_r, wb_g, wb_b);
+    r_update_out_map();
+    r_check_out_count();
+    generation = params.generation;
+  }
+  lut_apply(&r_lut, &r_levels[0][0], &r_dither[0][0], (u8*) pixels,
+            GRID_PIXELS*3);
+  pixels[GRID_BLACK].r = pixels[GRID_BLACK].g = pixels[GRID_BLACK].b = 0;
+  for (i = 0; i < r_out_count; i++) {
+    r_outs[i] = pixels[r_out_map[i]];
+  }
+  for (i = 0; i < num_outputs; i++) {
+    outputs[i].keepalive_interval = keepalive;
+    output_put_pixels(&outputs[i], r_frame_id, r_out_count, r_outs);
+  }
+}
+
+void r_draw_particles() {
+  static float sums[GRID_PIXELS][3];
+  int i, r, c, k;
+  float d, v, pr, pv;
+  particle* p;
+  float* level;
+  pixel dpx;
+
+  bzero(sums, sizeof(sums));
+  for (i = 0, p = particles; i < num_particles; i++, p++) {
+    pr = p->last_r + (p->r - p->last_r)*r_sim_alpha;
+    pv = p->last_val + (p->val - p->last_val)*r_sim_alpha;
+    for (r = 0; r < rows; r++) {
+      c = p->c;
+      d = pr - r;
+      v = pv/(1 + d*d);
+      dpx = hue_pixel(p->hue);
+
+      level = sums[r*25 + c];
+      level[0] = clamp_level(level[0] + v*dpx.r);
+      level[1] = clamp_level(level[1] + v*dpx.g);
+      level[2] = clamp_level(level[2] + v*dpx.b);
+    }
+  }
+
+  for (i = 0; i < GRID_PIXELS; i++) {
+    for (k = 0; k < 3; k++) {
+      r_levels[i][k] = sums[i][k]*257;
+    }
+  }
+  r_put_pixels();
+}
+
+void r_draw_invitation() {
+  float t = r_invitation_t + 0.01*r_sim_alpha;
+  char play_image[30][25] = {
     "                         ",
     "                         ",
     "                         ",
@@ -418,53 +1231,310 @@ void g_draw_invitation() {
     "                         "
   };
   
-  int i, j, shifted_r;
-  for (i = 0; i < 1250; i++) {
-    pixels[i].r = 0;
-    pixels[i].g = 0;
-    pixels[i].b = 0;
-  }
+  int i, j;
+  bzero(r_levels, sizeof(r_levels));
 
   float rr, gg, bb;
-  t += 0.01;
   for (i = 0; i < 30; i++) {
     for (j = 0; j < 25; j++) {
       rr = sin(t*5 + i*0.1 + j*0.02);
       gg = sin(t*3 + i*0.04 - j*0.1 + 1.3);
       bb = sin(t*7 - i*0.07 + j*0.05 + 2.7);
-      shifted_r = i + r_shift;
-      if (shifted_r >= 0 && shifted_r < 50) {
-        if (conduct_image[i][24-j] > 32) {
-          pixel_rc(shifted_r, j).r = (int) (max_val*rr);
-          pixel_rc(shifted_r, j).g = (int) (max_val*gg);
-          pixel_rc(shifted_r, j).b = (int) (max_val*bb);
-        }
+      if (conduct_image[i][24-j] > 32) {
+        // The wrap-around of negative values is part of the look.
+        r_levels[i*25 + j][0] = (u8) (int) (255*rr) * 257;
+        r_levels[i*25 + j][1] = (u8) (int) (255*gg) * 257;
+        r_levels[i*25 + j][2] = (u8) (int) (255*bb) * 257;
+      }
+    }
+  }
+
+  r_put_pixels();
+}
+
+// The capture time now, extrapolated from the last analyzed frame.  The
+// extrapolation is capped so that the simulation stops when capture does.
+double r_capture_now() {
+  double elapsed = get_time() - r_frame_wall_time;
+  return r_frame_time +
+      (elapsed < MAX_EXTRAPOLATION ? elapsed : MAX_EXTRAPOLATION);
+}
+
+// Adds the particles emitted by analysis since the last render.  Returns
+// when the newest of their frames was captured, or -1 if there were none.
+double r_take_emissions() {
+  emission e;
+  double captured = -1;
+  int i;
+  while (queue_pop(&emission_queue, &e)) {
+    stage_start(&render_stage, e.wall_time);
+    for (i = 0; i < e.count && num_particles < MAX_PARTICLES; i++) {
+      particles[num_particles++] = e.particles[i];
+    }
+    r_frame_time = e.time;
+    r_frame_wall_time = e.wall_time;
+    r_frame_id = e.frame;
+    captured = e.captured;
+  }
+  return captured;
+}
+
+void r_render(double dt) {
+  double start = get_time(), finish, captured;
+  if (r_reload_layout) {
+    r_reload_layout = 0;
+    load_layout();
+    r_out_map_stale = 1;
+    fprintf(stderr, "\nReloaded map.txt and ranges.txt.\n");
+  }
+  captured = r_take_emissions();
+  trace_begin("render", r_frame_id);
+  if (r_frame_time >= 0) {
+    r_sim_advance(r_capture_now());
+  }
+  if (num_particles < 5) {
+    r_quiet_time += dt;
+  } else {
+    r_quiet_time = 0;
+  }
+  if (r_quiet_time > 10) {
+    r_draw_invitation();
+  } else {
+    r_draw_particles();
+  }
+  trace_end("render", r_frame_id);
+  if (warm) {
+    checkpoint_begin(&warm->particles_section);
+    warm->num_particles = num_particles;
+    memcpy(warm->particles, particles, num_particles*sizeof(particle));
+    checkpoint_end(&warm->particles_section);
+  }
+  finish = stage_finish(&render_stage, start);
+  if (captured >= 0) {
+    hist_record(&end_to_end_hist, finish - captured);
+  }
+}
+
+// Renders and sends frames at out_hz on a fixed schedule, regardless of
+// when depth frames arrive.
+void* r_main(void* arg) {
+  double next = get_time(), now, dt;
+  trace_thread("render");
+  while (!r_should_quit) {
+    params_update();
+    dt = 1.0/out_hz;
+    now = get_time();
+    if (next > now) {
+      usleep((next - now)*1e6);
+    } else if (now - next > 0.1) {
+      next = now;  // fell far behind; start a new schedule
+    }
+    next += dt;
+    r_render(dt);
+  }
+  return NULL;
+}
+
+// Save thread functions.
+void* s_main(void* arg) {
+  struct timespec deadline;
+  double now, wait;
+
+  trace_thread("save");
+  pthread_mutex_lock(&save_mutex);
+  while (!s_should_quit || save_time) {
+    now = get_time();
+    if (save_time && (now >= save_time || s_should_quit)) {
+      save_time = 0;
+      pthread_mutex_unlock(&save_mutex);
+      params_update();
+      trace_begin("save", params.generation);
+      save_params("current.params", &params);
+      trace_end("save", params.generation);
+      pthread_mutex_lock(&save_mutex);
+      stat("current.params", &s_saved);
+    } else if (save_time) {
+      // The condition variable waits on the real-time clock.
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      wait = deadline.tv_sec + deadline.tv_nsec/1e9 + save_time - now;
+      deadline.tv_sec = wait;
+      deadline.tv_nsec = (wait - deadline.tv_sec)*1e9;
+      pthread_cond_timedwait(&save_cond, &save_mutex, &deadline);
+    } else {
+      pthread_cond_wait(&save_cond, &save_mutex);
+    }
+  }
+  pthread_mutex_unlock(&save_mutex);
+  return NULL;
+}
+
+// Watchdog thread functions.
+
+// Checks on a stage that should be making progress while busy is set.
+// Reports when it stalls and recovers, and returns 1 if it has stalled and
+// is due for a restart.
+int w_check(heartbeat* h, double timeout, int busy, double now) {
+  if (!h) return 0;
+  if (!busy || heartbeat_age(h) < timeout) {
+    if (h->stalled) {
+      fprintf(stderr, "\n%s recovered.\n", h->name);
+    }
+    h->stalled = 0;
+    return 0;
+  }
+  if (!h->stalled) {
+    fprintf(stderr, "\n%s stalled for %.0f ms.\n",
+            h->name, heartbeat_age(h)*1000);
+    h->stalls++;
+    h->stalled = 1;
+  }
+  if (now - h->last_restart < WATCH_RESTART_INTERVAL) return 0;
+  h->last_restart = now;
+  return 1;
+}
+
+int w_stalled(heartbeat* h) {
+  return h && h->stalled;
+}
+
+void* w_main(void* arg) {
+  double now, render_timeout, last_touch = 0;
+  int i, stalled;
+  output* out;
+
+  trace_thread("watchdog");
+  while (!w_should_quit) {
+    usleep(WATCH_INTERVAL*1e6);
+    params_update();
+    now = get_time();
+    render_timeout = 2/out_hz > WATCH_TIMEOUT ? 2/out_hz : WATCH_TIMEOUT;
+
+    // Re-open a live Kinect that has stopped sending frames.
+    if (w_check(f_heartbeat, WATCH_TIMEOUT,
+                now - f_start_time > WATCH_START_TIMEOUT, now) && f_context) {
+      f_heartbeat->restarts++;
+      f_restart = 1;
+    }
+    w_check(convert_stage.heartbeat, WATCH_TIMEOUT,
+            queue_count(&convert_queue) > 0, now);
+    w_check(analyze_stage.heartbeat, WATCH_TIMEOUT,
+            queue_count(&analyze_queue) > 0, now);
+    w_check(render_stage.heartbeat, render_timeout, 1, now);
+    w_check(g_heartbeat, WATCH_GLUT_TIMEOUT, 1, now);
+
+    // Reconnect an output that isn't getting frames through while the
+    // render thread is feeding it.
+    for (i = 0, out = outputs; i < num_outputs; i++, out++) {
+      if (w_check(out->heartbeat, render_timeout,
+                  heartbeat_age(render_stage.heartbeat) < render_timeout,
+                  now)) {
+        out->heartbeat->restarts++;
+        output_reconnect(out);
       }
     }
+
+    // The Kinect and the outputs are restarted in place, so only a stall
+    // elsewhere stops the touch and leaves the watchdog script to restart
+    // the whole process.
+    stalled = w_stalled(convert_stage.heartbeat) ||
+        w_stalled(analyze_stage.heartbeat) ||
+        w_stalled(render_stage.heartbeat) || w_stalled(g_heartbeat) ||
+        (!f_context && w_stalled(f_heartbeat));
+    if (!stalled && now - last_touch >= WATCH_TOUCH_INTERVAL) {
+      close(creat("/tmp/heartbeat", 0644));
+      last_touch = now;
+    }
   }
+  return NULL;
+}
 
-  g_put_pixel_ranges(pixels);
+// Convert thread functions.
+void c_convert(depth_frame* f) {
+  int i, j;
+  int x, y;
+  int cam_rot_int = cam_rot;
+  u16* data = f->raw;
+
+  switch (cam_rot_int) {
+    case 0:
+      for (i = 0; i < 640*480; i++) {
+        f->depth[i] = depth_to_mm(data[i]);
+      }
+      break;
+    case 1:
+      bzero(f->depth, 640*480*sizeof(u16));
+      for (x = 0; x < 480; x++) {
+        for (y = 0; y < 480; y++) {
+          i = y*640 + (x + 80);
+          j = x*640 + (479 - y) + 80 + y_shift;
+          f->depth[i] = depth_to_mm(data[j]);
+        }
+      }
+      break;
+    case 2:
+      for (x = 0; x < 640; x++) {
+        for (y = 0; y < 480; y++) {
+          i = y*640 + x;
+          j = (479 - y)*640 + (639 - x);
+          f->depth[i] = depth_to_mm(data[j]);
+        }
+      }
+      break;
+    case 3:
+      bzero(f->depth, 640*480*sizeof(u16));
+      for (x = 0; x < 480; x++) {
+        for (y = 0; y < 480; y++) {
+          i = y*640 + (x + 80);
+          j = (479 - x)*640 + y + 80 + y_shift;
+          f->depth[i] = depth_to_mm(data[j]);
+        }
+      }
+      break;
+  }
 }
 
-void g_emit_particles(col_record* col_records, col_record* last_col_records) {
+void* c_main(void* arg) {
+  depth_frame* f;
+  double start;
+  trace_thread("convert");
+  while (!c_should_quit) {
+    if (queue_wait(&convert_queue, &f, 0.1)) {
+      start = stage_start(&convert_stage, f->queued_time);
+      params_update();
+      trace_begin("convert", f->id);
+      c_convert(f);
+      trace_end("convert", f->id);
+      f->queued_time = stage_finish(&convert_stage, start);
+      queue_push(&analyze_queue, &f);
+    }
+  }
+  return NULL;
+}
+
+// Analysis thread functions.
+void a_emit_particles(col_record* col_records, col_record* last_col_records,
+                      emission* e) {
   particle* p;
   int r, c;
   float v;
   float depth;
   float depth_frac;
 
+  e->count = 0;
   for (c = 0; c < cols; c++) {
     if (col_records[c].altitude && last_col_records[c].altitude) {
       depth = col_records[c].depth_m;
       v = (col_records[c].altitude - last_col_records[c].altitude)/depth;
-      if (fabs(v) > emit_min_v && num_particles < MAX_PARTICLES) {
-        p = &(particles[num_particles++]);
+      if (fabs(v) > emit_min_v) {
+        p = &(e->particles[e->count++]);
         p->c = c;
         p->r = 40 - col_records[c].altitude*20/480;
         p->v = -v*emit_velf;
         p->hue = (depth - min_depth)/(max_depth - min_depth)*hue_cycles;
         p->sat = 1;
         p->val = fabs(v)*emit_valf;
+        p->last_r = p->r;
+        p->last_val = p->val;
         //if (p->c == 0 || p->c == 24) {
         //  fprintf(stderr, "emit: @%.1f,%.1f v=%3.1f hue=%4.2f val=%4.1f \n",
         //          p->c, p->r, p->v, p->hue, p->val);
@@ -474,80 +1544,53 @@ void g_emit_particles(col_record* col_records, col_record* last_col_records) {
   }
 }
 
-void g_draw_pixels(u16* depth) {
-  pixel pixels[50*25], p;
-  s32 i, d, v;
-  u8 hi, lo;
-  s32 min_mm = min_depth*1000;
-  s32 max_mm = max_depth*1000;
-  int r, c, shifted_r;
-
-  bzero(pixels, 25*50*sizeof(pixel));
-  for (c = 0; c < 25; c++) {
-    for (r = 0; r < 50; r++) {
-      d = depth[(r*480/50)*640 + (c*640/25)];
-      d = d < min_mm ? min_mm : d > max_mm ? max_mm : d;
-      v = (d - min_mm) * (256*4) / (max_mm - min_mm);
-      hi = v >> 8, lo = v & 0xff;
-      v == 0 ? set_pixel(p, 255, 255, 255) :
-          v == 256*4 ? set_pixel(p, 0, 0, 0) :
-          hi == 0 ? set_pixel(p, 255, lo, 0) :
-          hi == 1 ? set_pixel(p, 255 - lo, 255, 0) :
-          hi == 2 ? set_pixel(p, 0, 255, lo) :
-          hi == 3 ? set_pixel(p, 0, 255 - lo, 255) :
-          set_pixel(p, 128, 128, 128);
-      shifted_r = r + r_shift;
-      if (shifted_r >= 0 && shifted_r < 50) {
-        pixel_rc(shifted_r, c) = p;
-      }
-    }
-  }
-  opc_put_pixels(g_sink, 1, 1250, pixels);
-}
-
 int compare_samples(const void* a, const void* b) {
   u16 av = ((col_record*) a)->altitude;
   u16 bv = ((col_record*) b)->altitude;
   return av > bv ? 1 : av < bv ? -1 : 0;
 }
 
-void g_analyze_columns(u16* depth, col_record* col_records) {
+void a_analyze_columns(u16* depth, col_record* col_records) {
   int x, y, c, i;
-  int min_x = (640 - x_width) / 2;
-  int min_y = (480 - y_height) / 2;
-  int max_y = min_y + y_height;
+  int min_y = derived.min_y, max_y = derived.max_y;
+  int discard = derived.discard;
+  s32 min_mm = derived.min_mm, max_mm = derived.max_mm;
   col_record samples[50], candidate;
-  int num_samples, discard;
-  s32 min_mm = min_depth*1000;
-  s32 max_mm = max_depth*1000;
+  int num_samples;
+  s32 mm, last_mm;
   s32 altitude_sum, count;
   double d, last_d;
   double depth_sum;
 
-#define depth_xy(x, y) depth[(x) + (y)*640]/1000.0
+#define in_range(mm) ((mm) > min_mm && (mm) < max_mm)
 
-  discard = (x_width/25)*0.1;
-  discard = (discard < 1) ? 1 : discard;
   for (c = 0; c < 25; c++) {
     num_samples = 0;
-    for (x = min_x + (x_width*c/25); x < min_x + (x_width*(c + 1)/25); x++) {
+    for (x = derived.col_start[c]; x < derived.col_end[c]; x++) {
       for (y = min_y; y < max_y; y++) {
-        d = depth_xy(x, y);
-        if (d <= min_depth || d >= max_depth) break;
+        if (!in_range(depth[x + y*640])) break;
       }
+      // Only in-range depths are converted to metres; last_mm holds the
+      // previous depth until it's needed, or -1 once last_d is current.
       last_d = max_depth;
+      last_mm = -1;
       candidate.depth_m = 1e9;
       for (; y < max_y; y++) {
-        d = depth_xy(x, y);
-        if (d > min_depth && d < max_depth) {
+        mm = depth[x + y*640];
+        if (in_range(mm)) {
+          d = mm/1000.0;
+          if (last_mm >= 0) last_d = last_mm/1000.0;
           if (last_d - d > depth_step) {  // look for a depth jump
             if (d < candidate.depth_m) {  // pick nearest
               candidate.altitude = 479 - y;
               candidate.depth_m = d;
             }
           }
+          last_d = d;
+          last_mm = -1;
+        } else {
+          last_mm = mm;
         }
-        last_d = d;
       }
       if (candidate.depth_m < 1e9) {
         samples[num_samples++] = candidate;
@@ -572,152 +1615,46 @@ void g_analyze_columns(u16* depth, col_record* col_records) {
   }
 }
 
-// Doesn't work if declared local within g_display().  First 10 entries of last_col_records get overwritten with garbage.
-static col_record col_records[25], last_col_records[25];
-
-void g_display() {
-  static int quiet_frames = 0;
-  pixel frame[640*480];
-
-  if (g_should_quit) {
-    g_quit();
-  }
-
-  // Wait for depth data to be ready in f_depth, then swap it into g_depth.
-  if (!depth_ready) return;
-  pthread_mutex_lock(&depth_ready_mutex);
-  while (!depth_ready) {
-    pthread_cond_wait(&depth_ready_cond, &depth_ready_mutex);
-  }
-  SWAP(u16*, f_depth, g_depth);
-  depth_ready = 0;
-  pthread_mutex_unlock(&depth_ready_mutex);
-
-  // Extract geometry from the depth frame.
-  g_analyze_columns(g_depth, col_records);
-
-  // Emit particles.
-  g_emit_particles(col_records, last_col_records);
-
-  // Draw particles from the depth data.
-  if (num_particles < 5) {
-    quiet_frames++;
-  } else {
-    quiet_frames = 0;
-  }
-  if (quiet_frames > 30*10) {
-    g_draw_invitation();
-  } else {
-    g_draw_particles();
-  }
-
-  // Advance particles.
-  g_advance_particles();
-  memcpy(last_col_records, col_records, sizeof(col_record)*25);
-
-  // Draw the frame from the depth data.
-  g_draw_frame(frame, g_depth, col_records);
-
-  // Paint the frame into the display buffer.
-  glBindTexture(GL_TEXTURE_2D, g_texture);
-  glTexImage2D(
-      GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, frame);
-  glBegin(GL_TRIANGLE_FAN);
-  glColor4f(1, 1, 1, 1);
-  glTexCoord2f(0, 0);
-  glVertex3f(0, 0, 0);
-  glTexCoord2f(1, 0);
-  glVertex3f(640, 0, 0);
-  glTexCoord2f(1, 1);
-  glVertex3f(640, 480, 0);
-  glTexCoord2f(0, 1);
-  glVertex3f(0, 480, 0);
-  glEnd();
-  glutSwapBuffers();
-}
-
-void g_special(int key, int x, int y);
-
-void g_keypress(unsigned char key, int x, int y) {
-  char filename[10] = "0.params";
-  char* unshifted = "0123456789";
-  char* shifted = ")!@#$%^&*(";
-  char* p;
-  int i;
-
-  if (key == 27) {
-    g_should_quit = 1;
-  }
-  if (key == ' ') {
-    f_paused = !f_paused;
-  }
-  if (p = strchr(unshifted, key)) {
-    i = p - unshifted;
-    filename[0] = unshifted[i];
-    if (g_load_params(filename)) {
-      fprintf(stderr, "\nLoaded %s.", filename);
-      g_show_params();
-    }
-    g_save_params("current.params");
-  }
-  if (p = strchr(shifted, key)) {
-    i = p - shifted;
-    filename[0] = unshifted[i];
-    if (g_save_params(filename)) {
-      fprintf(stderr, "\nSaved %s.\n", filename);
+col_record a_last_col_records[25];
+
+void* a_main(void* arg) {
+  depth_frame* f;
+  emission e;
+  double start, emitted;
+  trace_thread("analyze");
+  while (!a_should_quit) {
+    if (queue_wait(&analyze_queue, &f, 0.1)) {
+      start = stage_start(&analyze_stage, f->queued_time);
+      hist_record(&capture_to_analysis_hist, start - f->captured);
+      params_update();
+      derived_update();
+      trace_begin("analyze", f->id);
+      a_analyze_columns(f->depth, f->col_records);
+      trace_end("analyze", f->id);
+      trace_begin("emit", f->id);
+      emitted = get_time();
+      a_emit_particles(f->col_records, a_last_col_records, &e);
+      hist_record(&emission_hist, get_time() - emitted);
+      trace_end("emit", f->id);
+      memcpy(a_last_col_records, f->col_records, sizeof(a_last_col_records));
+      if (warm) {
+        checkpoint_begin(&warm->columns_section);
+        memcpy(warm->col_records, a_last_col_records,
+               sizeof(a_last_col_records));
+        checkpoint_end(&warm->columns_section);
+      }
+      e.time = f->time;
+      e.captured = f->captured;
+      e.frame = f->id;
+      e.wall_time = f->queued_time = stage_finish(&analyze_stage, start);
+      queue_push(&emission_queue, &e);
+      if (!preview_wanted || !queue_push(&preview_queue, &f)) {
+        queue_push(&skipped_frames, &f);
+      } else {
+        preview_wanted = 0;
+      }
     }
   }
-
-  if (key == '=' || key == '+') g_special(GLUT_KEY_UP, x, y);
-  if (key == '-' || key == '_') g_special(GLUT_KEY_DOWN, x, y);
-  if (key == '[') g_special(GLUT_KEY_LEFT, x, y);
-  if (key == ']') g_special(GLUT_KEY_RIGHT, x, y);
-}
-
-void g_special(int key, int x, int y) {
-  param* p = &g_params[g_selected_param];
-  int shift = glutGetModifiers() & GLUT_ACTIVE_SHIFT;
-  int ctrl = glutGetModifiers() & GLUT_ACTIVE_CTRL;
-  float mag = (shift ? 10 : 1) * (ctrl ? 0.1 : 1);
-  switch (key) {
-    case GLUT_KEY_UP:
-      p->value = p->modulo ? ((int) (p->value + p->delta)) % p->modulo :
-          p->value + p->delta*mag;
-      p->value = p->value > p->max ? p->max : p->value;
-      g_save_params("current.params");
-      break;
-    case GLUT_KEY_DOWN:
-      p->value = p->modulo ?
-          ((int) (p->value + p->modulo - p->delta)) % p->modulo :
-          p->value - p->delta*mag;
-      p->value = p->value < p->min ? p->min : p->value;
-      g_save_params("current.params");
-      break;
-    case GLUT_KEY_LEFT:
-      g_selected_param = (g_selected_param + g_num_params - 1) % g_num_params;
-      break;
-    case GLUT_KEY_RIGHT:
-      g_selected_param = (g_selected_param + 1) % g_num_params;
-      break;
-  }
-  g_show_params();
-}
-
-void* g_main(void* arg) {
-  int argc = 0;
-  char* argv = NULL;
-
-  glutInit(&argc, &argv);
-  glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA | GLUT_DEPTH);
-  glutInitWindowSize(640, 480);
-  glutInitWindowPosition(0, 0);
-  g_window = glutCreateWindow("depth camera");
-  glutDisplayFunc(g_display);
-  glutIdleFunc(g_display);
-  glutKeyboardFunc(g_keypress);
-  glutSpecialFunc(g_special);
-  g_init(640, 480);
-  glutMainLoop();
   return NULL;
 }
 
@@ -731,96 +1668,126 @@ int num_frames = 0;
 int f_count = 0;
 frame* frames;
 FILE* play_fp = NULL;
-int f_heartbeat_count = 0;
+double f_playback_clock = 0;
 
 #define TIMING_FRAMES 30
 double frame_times[TIMING_FRAMES];
 int f_time_i = 0;
 
-double get_time() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec + tv.tv_usec/1e6;
-}
-
 void f_depth_callback(freenect_device* dev, void* data, u32 timestamp) {
-  int i, j;
-  int x, y;
-  int cam_rot_int = cam_rot;
-  double now, interval;
+  int i;
+  double start, now, interval, send_time = 0, max_send_time = 0;
+  int backlog = 0, dropped = 0, skipped = 0;
+  output* out;
+  depth_frame* f;
 
+  heartbeat_beat(f_heartbeat);
   if (!f_paused) {
-    pthread_mutex_lock(&depth_ready_mutex);
-    switch (cam_rot_int) {
-      case 0:
-        for (i = 0; i < 640*480; i++) {
-          f_depth[i] = depth_to_mm(((u16*) data)[i]);
-        }
-        break;
-      case 1:
-        bzero(f_depth, 640*480*sizeof(u16));
-        for (x = 0; x < 480; x++) {
-          for (y = 0; y < 480; y++) {
-            i = y*640 + (x + 80);
-            j = x*640 + (479 - y) + 80 + y_shift;
-            f_depth[i] = depth_to_mm(((u16*) data)[j]);
-          }
-        }
-        break;
-      case 2:
-        for (x = 0; x < 640; x++) {
-          for (y = 0; y < 480; y++) {
-            i = y*640 + x;
-            j = (479 - y)*640 + (639 - x);
-            f_depth[i] = depth_to_mm(((u16*) data)[j]);
-          }
-        }
-        break;
-      case 3:
-        bzero(f_depth, 640*480*sizeof(u16));
-        for (x = 0; x < 480; x++) {
-          for (y = 0; y < 480; y++) {
-            i = y*640 + (x + 80);
-            j = (479 - x)*640 + y + 80 + y_shift;
-            f_depth[i] = depth_to_mm(((u16*) data)[j]);
-          }
-        }
-        break;
+    trace_begin("capture", capture_stage.count);
+    if (queue_pop(&free_frames, &f) || queue_pop(&skipped_frames, &f)) {
+      // Live frames are stamped with the wall clock; recorded frames with a
+      // clock that follows the recording, so that playback is reproducible.
+      start = get_time();
+      f->time = dev ? start : f_playback_clock;
+      f->captured = start;
+      f->id = capture_stage.count;
+      memcpy(f->raw, data, sizeof(f->raw));
+      f->queued_time = stage_finish(&capture_stage, start);
+      queue_push(&convert_queue, &f);  // it holds every frame, so never full
+      trace_end("capture", f->id);
+    } else {
+      capture_stage.dropped++;
+      trace_end("capture", capture_stage.count);
     }
-    depth_ready = 1;
-    pthread_cond_signal(&depth_ready_cond);
-    pthread_mutex_unlock(&depth_ready_mutex);
 
     f_time_i = (f_time_i + 1) % TIMING_FRAMES;
     now = get_time();
     interval = now - frame_times[f_time_i];
     frame_times[f_time_i] = now;
 
-    fprintf(stderr, "%5.1f fps / frame: %5d / particles: %3d \r",
-            TIMING_FRAMES/interval, f_count, num_particles);
+    // Report the slowest output and the total backlog and drops.
+    for (i = 0, out = outputs; i < num_outputs; i++, out++) {
+      send_time = out->last_send_time > send_time ?
+          out->last_send_time : send_time;
+      max_send_time = out->max_send_time > max_send_time ?
+          out->max_send_time : max_send_time;
+      backlog += output_backlog(out);
+      dropped += out->frames_dropped;
+      skipped += out->frames_skipped;
+    }
+    fprintf(stderr, "%5.1f fps / frame: %5d / particles: %3d / "
+            "send: %5.1f ms (max %5.1f) / backlog: %d / dropped: %d / "
+            "skipped: %d \r",
+            TIMING_FRAMES/interval, f_count, num_particles,
+            send_time*1000, max_send_time*1000, backlog, dropped, skipped);
     f_count++;
   }
-  if ((f_heartbeat_count++ & 31) == 0) close(creat("/tmp/heartbeat", 0644));
 }
 
 void* f_main(void* arg) {
-  freenect_set_led(f_device, LED_OFF);
-  freenect_set_depth_callback(f_device, f_depth_callback);
-  freenect_set_depth_mode(f_device, freenect_find_depth_mode(
-      FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
-  freenect_start_depth(f_device);
-  while (!f_should_quit && freenect_process_events(f_context) >= 0);
-  freenect_stop_depth(f_device);
-  freenect_close_device(f_device);
+  struct timeval timeout;
+
+  trace_thread("capture");
+  while (!f_should_quit) {
+    if (!f_device && freenect_open_device(f_context, &f_device, 0) < 0) {
+      f_device = NULL;
+      usleep(500000);
+      continue;
+    }
+    freenect_set_led(f_device, LED_OFF);
+    freenect_set_depth_callback(f_device, f_depth_callback);
+    freenect_set_depth_mode(f_device, freenect_find_depth_mode(
+        FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
+    freenect_start_depth(f_device);
+    f_start_time = get_time();
+    f_restart = 0;
+    do {
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 10000;
+    } while (!f_should_quit && !f_restart &&
+             freenect_process_events_timeout(f_context, &timeout) >= 0);
+
+    // Stopped by the watchdog or an error: close the device, and re-open it
+    // unless quitting.
+    freenect_stop_depth(f_device);
+    freenect_close_device(f_device);
+    f_device = NULL;
+    if (!f_should_quit) {
+      fprintf(stderr, "\nRe-opening the Kinect.\n");
+    }
+  }
   freenect_shutdown(f_context);
   return NULL;
 }
 
+// Reads up to MAX_FRAMES recorded frames into frames.
+void f_read_frames(FILE* fp) {
+  if (!frames) {
+    frames = malloc(MAX_FRAMES*sizeof(frame));
+  }
+  for (num_frames = 0; num_frames < MAX_FRAMES; num_frames++) {
+    if (fread(&(frames[num_frames]), sizeof(frame), 1, fp) == 0) {
+      break;
+    }
+  }
+}
+
+double f_frame_interval(frame* a, frame* b) {
+  double interval = (b->time.tv_sec - a->time.tv_sec) +
+      (b->time.tv_usec - a->time.tv_usec)/1e6;
+  return (interval > 0 && interval < 1) ? interval : SIM_DT;
+}
+
 void* f_playback_main(void* arg) {
   int f, i;
+  trace_thread("capture");
   while (!f_should_quit) {
     for (f = 0; f < num_frames && !f_should_quit; f++) {
       f_count = f;
+      if (!f_paused) {
+        f_playback_clock += f > 0 ?
+            f_frame_interval(&frames[f - 1], &frames[f]) : SIM_DT;
+      }
       f_depth_callback(NULL, frames[f].depth, 0);
       usleep(30000); 
       f -= f_paused;
@@ -828,6 +1795,7 @@ void* f_playback_main(void* arg) {
     f = num_frames - 1;
     for (i = 0; i < 60 && !f_should_quit; i++) {
       f_count = f;
+      f_playback_clock += f_paused ? 0 : SIM_DT;
       f_depth_callback(NULL, frames[f].depth, 0);
       i -= f_paused;
     }
@@ -836,38 +1804,790 @@ void* f_playback_main(void* arg) {
   return NULL;
 }
 
-int main(int argc, char** argv) {
+// "h_" variables belong to a headless run (see h_sweep), which replays
+// recordings through convert, analysis and render on a single thread, with
+// no window, device or outputs.
+#define H_MAX_AXES 16
+#define H_MAX_VALUES 64
+
+typedef struct {
+  int param;  // index into g_params
+  int count;
+  float values[H_MAX_VALUES];
+} h_axis;
+
+int h_num_axes = 0;
+h_axis h_axes[H_MAX_AXES];
+float h_base_params[MAX_PARAMS];  // the params that the axes vary from
+
+// Time spent in each stage of h_step.
+#define H_STAGES 4
+char* h_stage_names[H_STAGES] = {"convert", "analyze", "emit", "render"};
+hist h_stage_hists[H_STAGES];
+
+// A golden trace is a header followed by, for each frame of a recording, a
+// golden_frame and then out_count pixels of output.
+#define GOLDEN_MAGIC "play-golden 1"
+
+typedef struct {
+  char magic[16];
+  s32 num_params;
+  s32 num_frames;
+  float params[MAX_PARAMS];  // the params the trace was made with
+} golden_header;
+
+typedef struct {
+  s32 num_particles;
+  s32 out_count;
+  col_record col_records[25];
+} golden_frame;
+
+// Benchmarks time each kernel after an untimed setup, first BENCH_WARMUP
+// times to warm up and then $BENCH_REPS times under the clock.
+#define BENCH_WARMUP 20
+#define BENCH_DEFAULT_REPS 200
+
+int h_bench_reps = BENCH_DEFAULT_REPS;
+int h_bench_recorded = 0;  // whether to use the recorded frames as input
+int h_bench_next_frame = 0;
+depth_frame h_bench_frame;
+col_record h_bench_last_col_records[25];
+int h_bench_particles = 0;  // how many particles each setup restores
+scene h_bench_scene;  // the synthetic input
+particle h_bench_saved_particles[MAX_PARTICLES];
+
+// Headless functions.
+
+// Per-run results of a sweep.
+typedef struct {
+  int frames;
+  double particles_mean;
+  int particles_max;
+  double emitted_per_s;  // particles per second of capture time
+  double frame_ms_mean, frame_ms_p99;  // convert to render, per frame
+  double output_energy;  // mean output level, from 0 to 1
+} h_result;
+
+// Clears the state that carries over from frame to frame.
+void h_reset() {
+  num_particles = 0;
+  bzero(a_last_col_records, sizeof(a_last_col_records));
+  bzero(r_dither, sizeof(r_dither));
+  r_frame_time = -1;
+  r_sim_time = -1;
+  r_sim_accum = 0;
+  r_sim_alpha = 0;
+}
+
+// Runs one recorded frame, captured at time t in seconds, through the
+// same stages as the pipeline: convert, analyze, emit, then one render at
+// the frame's capture time.  Returns the number of particles emitted.
+int h_step(depth_frame* f, double t) {
+  emission e;
+  double times[H_STAGES + 1];
+  int i;
+
+  params_update();
+  derived_update();
+  times[0] = get_time();
+  c_convert(f);
+  times[1] = get_time();
+  a_analyze_columns(f->depth, f->col_records);
+  times[2] = get_time();
+  a_emit_particles(f->col_records, a_last_col_records, &e);
+  memcpy(a_last_col_records, f->col_records, sizeof(a_last_col_records));
+  times[3] = get_time();
+  for (i = 0; i < e.count && num_particles < MAX_PARTICLES; i++) {
+    particles[num_particles++] = e.particles[i];
+  }
+  r_frame_time = t;
+  r_sim_advance(t);
+  r_draw_particles();
+  times[4] = get_time();
+  for (i = 0; i < H_STAGES; i++) {
+    hist_record(&h_stage_hists[i], times[i + 1] - times[i]);
+  }
+  return e.count;
+}
+
+// Sets the params for run number run: the mixed-radix digits of run pick
+// a value from each axis, the first axis varying fastest.
+void h_set_params(int run) {
+  int a, p;
+  for (p = 0; p < g_num_params; p++) {
+    g_params[p].value = h_base_params[p];
+  }
+  for (a = 0; a < h_num_axes; a++) {
+    g_params[h_axes[a].param].value = h_axes[a].values[run % h_axes[a].count];
+    run /= h_axes[a].count;
+  }
+  g_publish_params();
+}
+
+// Replays the recorded frames with the params of run number run.
+void h_run(int run, h_result* result) {
+  static depth_frame f;
+  static hist frame_hist;
+  double t = 0, start, particle_sum = 0, energy_sum = 0;
+  long emitted = 0;
+  int i, k;
+
+  h_set_params(run);
+  h_reset();
+  bzero(&frame_hist, sizeof(frame_hist));
+  bzero(result, sizeof(h_result));
+  for (i = 0; i < num_frames; i++) {
+    t += i > 0 ? f_frame_interval(&frames[i - 1], &frames[i]) : SIM_DT;
+    memcpy(f.raw, frames[i].depth, sizeof(f.raw));
+    start = get_time();
+    emitted += h_step(&f, t);
+    hist_record(&frame_hist, get_time() - start);
+    particle_sum += num_particles;
+    if (num_particles > result->particles_max) {
+      result->particles_max = num_particles;
+    }
+    for (k = 0; k < r_out_count; k++) {
+      energy_sum += (r_outs[k].r + r_outs[k].g + r_outs[k].b)/
+          (3*255.0*r_out_count);
+    }
+  }
+  if (num_frames) {
+    result->frames = num_frames;
+    result->particles_mean = particle_sum/num_frames;
+    result->emitted_per_s = emitted/t;
+    result->frame_ms_mean = frame_hist.sum_us/1e3/num_frames;
+    result->frame_ms_p99 = hist_quantile(&frame_hist, 0.99)*1e3;
+    result->output_energy = energy_sum/num_frames;
+  }
+}
+
+// Reads the sweep grid: each line of the file is a param name followed by
+// the values to try for it.  Every combination of values is a run.
+// Returns the number of runs.
+int h_read_axes(char* filename) {
+  char line[1000];
+  char* word;
+  h_axis* axis;
+  int runs = 1, p;
+  FILE* fp = fopen(filename, "r");
+
+  if (!fp) {
+    fprintf(stderr, "Could not read %s\n", filename);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), fp) && h_num_axes < H_MAX_AXES) {
+    if (!(word = strtok(line, " \t\n")) || word[0] == '#') continue;
+    for (p = 0; p < g_num_params; p++) {
+      if (strcmp(word, g_params[p].name) == 0) break;
+    }
+    if (p == g_num_params) {
+      fprintf(stderr, "Unknown param in %s: %s\n", filename, word);
+      exit(1);
+    }
+    axis = &h_axes[h_num_axes++];
+    axis->param = p;
+    for (axis->count = 0; axis->count < H_MAX_VALUES &&
+         (word = strtok(NULL, " \t\n")); axis->count++) {
+      axis->values[axis->count] = atof(word);
+    }
+    if (!axis->count) {
+      axis->values[axis->count++] = g_params[p].value;
+    }
+    runs *= axis->count;
+  }
+  fclose(fp);
+  return runs;
+}
+
+// Replays each recording with every set of params in the sweep file, spread
+// over $SWEEP_JOBS worker processes (by default, one per CPU), and writes a
+// CSV line of results for each run to stdout.
+int h_sweep(char* sweep_filename, int num_recordings, char** recordings) {
+  h_result* results;
+  char* jobs_env = getenv("SWEEP_JOBS");
+  int jobs = jobs_env ? atoi(jobs_env) : sysconf(_SC_NPROCESSORS_ONLN);
+  int runs, run, job, i, a, p;
   FILE* fp;
-  int r, c;
 
-  fp = fopen("ranges.txt", "r");
-  if (fp) {
-    while (fscanf(fp, "%d %d\n",
-                  &(g_pixel_ranges[g_num_pixel_ranges].start),
-                  &(g_pixel_ranges[g_num_pixel_ranges].stop)) == 2) {
-      g_num_pixel_ranges++;
+  for (p = 0; p < g_num_params; p++) {
+    h_base_params[p] = g_params[p].value;
+  }
+  runs = h_read_axes(sweep_filename);
+  jobs = jobs < 1 ? 1 : jobs > runs ? runs : jobs;
+  color_init();
+  load_layout();
+  results = mmap(NULL, runs*sizeof(h_result), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    fprintf(stderr, "Could not map the results of %d runs\n", runs);
+    return 1;
+  }
+
+  printf("recording,run");
+  for (a = 0; a < h_num_axes; a++) {
+    printf(",%s", g_params[h_axes[a].param].name);
+  }
+  printf(",frames,particles_mean,particles_max,emitted_per_s,"
+         "frame_ms_mean,frame_ms_p99,output_energy\n");
+  fflush(stdout);
+
+  for (i = 0; i < num_recordings; i++) {
+    fp = fopen(recordings[i], "r");
+    if (!fp) {
+      fprintf(stderr, "Could not read %s\n", recordings[i]);
+      return 1;
     }
+    f_read_frames(fp);
     fclose(fp);
+    fprintf(stderr, "%s: %d frames x %d runs on %d jobs\n",
+            recordings[i], num_frames, runs, jobs);
+
+    // Each worker takes every jobs'th run, and leaves its results in the
+    // shared mapping.
+    for (job = 0; job < jobs; job++) {
+      if (fork() == 0) {
+        for (run = job; run < runs; run += jobs) {
+          h_run(run, &results[run]);
+        }
+        _exit(0);
+      }
+    }
+    while (wait(NULL) > 0);
+
+    for (run = 0; run < runs; run++) {
+      h_set_params(run);
+      printf("%s,%d", recordings[i], run);
+      for (a = 0; a < h_num_axes; a++) {
+        printf(",%g", g_params[h_axes[a].param].value);
+      }
+      printf(",%d,%.2f,%d,%.2f,%.3f,%.3f,%.4f\n", results[run].frames,
+             results[run].particles_mean, results[run].particles_max,
+             results[run].emitted_per_s, results[run].frame_ms_mean,
+             results[run].frame_ms_p99, results[run].output_energy);
+    }
+    fflush(stdout);
   }
+  munmap(results, runs*sizeof(h_result));
+  return 0;
+}
 
-  fp = fopen("map.txt", "r");
-  if (fp) {
-    for (r = 0; r < rows; r++) {
-      for (c = 0; c < cols; c++) {
-        fscanf(fp, "%d", &(pixel_map[r][c]));
+// Counts the differences between a frame and its golden frame, allowing
+// each value to be off by tolerance units: LED levels, rows of altitude,
+// millimetres of depth, or particles.  Describes the first few.
+int h_compare_frame(int i, golden_frame* golden, pixel* golden_outs,
+                    golden_frame* actual, pixel* outs, int tolerance,
+                    int* max_diff) {
+  static int reported = 0;
+  int diffs = 0, c, k, d;
+  col_record* g;
+  col_record* a;
+  u8* gp = (u8*) golden_outs;
+  u8* ap = (u8*) outs;
+
+  if (abs(golden->num_particles - actual->num_particles) > tolerance) {
+    if (reported++ < 10) {
+      fprintf(stderr, "Frame %d: %d particles, expected %d\n",
+              i, actual->num_particles, golden->num_particles);
+    }
+    diffs++;
+  }
+  for (c = 0; c < 25; c++) {
+    g = &golden->col_records[c];
+    a = &actual->col_records[c];
+    if (abs(g->altitude - a->altitude) > tolerance ||
+        abs(g->depth_mm - a->depth_mm) > tolerance ||
+        fabs(g->depth_m - a->depth_m) > tolerance*0.001) {
+      if (reported++ < 10) {
+        fprintf(stderr, "Frame %d, column %d: altitude %d, depth %.6f m; "
+                "expected %d, %.6f m\n", i, c, a->altitude, a->depth_m,
+                g->altitude, g->depth_m);
       }
-      fscanf(fp, "\n");
+      diffs++;
     }
   }
+  if (golden->out_count != actual->out_count) {
+    if (reported++ < 10) {
+      fprintf(stderr, "Frame %d: %d output pixels, expected %d\n",
+              i, actual->out_count, golden->out_count);
+    }
+    return diffs + 1;
+  }
+  for (k = 0; k < actual->out_count*3; k++) {
+    d = abs(gp[k] - ap[k]);
+    *max_diff = d > *max_diff ? d : *max_diff;
+    if (d > tolerance) {
+      if (reported++ < 10) {
+        fprintf(stderr, "Frame %d, pixel %d: channel %d is %d, expected %d\n",
+                i, k/3, k%3, ap[k], gp[k]);
+      }
+      diffs++;
+    }
+  }
+  return diffs;
+}
 
-  if (argc > 1) {
-    g_sink = opc_new_sink(argv[1]);
-    if (g_sink < 0) {
+// Replays a recording one frame per SIM_DT of capture time, and writes what
+// it produces to a golden trace (if update is set) or compares it against
+// one, allowing each value to differ by $GOLDEN_TOLERANCE.  The params come
+// from current.params when writing and from the trace when comparing; the
+// layout always comes from map.txt and ranges.txt.  Reports the time spent
+// in each stage.  Returns 0 if everything matched.
+int h_golden(char* trace_filename, char* recording, int update) {
+  static depth_frame f;
+  static pixel golden_outs[MAX_OUT_PIXELS];
+  char* tolerance_env = getenv("GOLDEN_TOLERANCE");
+  int tolerance = tolerance_env ? atoi(tolerance_env) : 0;
+  golden_header header;
+  golden_frame golden, actual;
+  int i, p, diffs, frames_differing = 0, max_diff = 0;
+  FILE* fp;
+
+  fp = fopen(recording, "r");
+  if (!fp) {
+    fprintf(stderr, "Could not read %s\n", recording);
+    return 1;
+  }
+  f_read_frames(fp);
+  fclose(fp);
+
+  fp = fopen(trace_filename, update ? "w" : "r");
+  if (!fp) {
+    fprintf(stderr, "Could not open %s\n", trace_filename);
+    return 1;
+  }
+  if (update) {
+    bzero(&header, sizeof(header));
+    strcpy(header.magic, GOLDEN_MAGIC);
+    header.num_params = g_num_params;
+    header.num_frames = num_frames;
+    for (p = 0; p < g_num_params; p++) {
+      header.params[p] = g_params[p].value;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+  } else {
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        strncmp(header.magic, GOLDEN_MAGIC, sizeof(header.magic)) != 0 ||
+        header.num_params != g_num_params ||
+        header.num_frames != num_frames) {
+      fprintf(stderr, "%s is not a golden trace of %d frames with %d "
+              "params\n", trace_filename, num_frames, g_num_params);
+      return 1;
+    }
+    for (p = 0; p < g_num_params; p++) {
+      g_params[p].value = header.params[p];
+    }
+  }
+
+  color_init();
+  load_layout();
+  g_publish_params();
+  h_reset();
+  for (i = 0; i < num_frames; i++) {
+    memcpy(f.raw, frames[i].depth, sizeof(f.raw));
+    h_step(&f, (i + 1)*SIM_DT);
+    bzero(&actual, sizeof(actual));
+    actual.num_particles = num_particles;
+    actual.out_count = r_out_count;
+    memcpy(actual.col_records, f.col_records, sizeof(actual.col_records));
+    if (update) {
+      fwrite(&actual, sizeof(actual), 1, fp);
+      fwrite(r_outs, sizeof(pixel), r_out_count, fp);
+      continue;
+    }
+    if (fread(&golden, sizeof(golden), 1, fp) != 1 ||
+        golden.out_count < 0 || golden.out_count > MAX_OUT_PIXELS ||
+        fread(golden_outs, sizeof(pixel), golden.out_count, fp) !=
+            golden.out_count) {
+      fprintf(stderr, "%s ends at frame %d\n", trace_filename, i);
+      return 1;
+    }
+    diffs = h_compare_frame(i, &golden, golden_outs, &actual, r_outs,
+                            tolerance, &max_diff);
+    frames_differing += diffs > 0;
+  }
+  fclose(fp);
+
+  printf("%-8s %8s %8s %8s\n", "stage", "mean ms", "p50 ms", "p99 ms");
+  for (i = 0; i < H_STAGES; i++) {
+    printf("%-8s %8.3f %8.3f %8.3f\n", h_stage_names[i],
+           h_stage_hists[i].sum_us/1e3/hist_count(&h_stage_hists[i]),
+           hist_quantile(&h_stage_hists[i], 0.5)*1e3,
+           hist_quantile(&h_stage_hists[i], 0.99)*1e3);
+  }
+  if (update) {
+    printf("Wrote %d frames to %s.\n", num_frames, trace_filename);
+    return 0;
+  }
+  printf("%d of %d frames differ from %s (largest LED difference %d, "
+         "tolerance %d).\n", frames_differing, num_frames, trace_filename,
+         max_diff, tolerance);
+  return frames_differing > 0;
+}
+
+// Sets one param by name, and publishes the change.
+void h_set_param(char* name, float value) {
+  int p;
+  for (p = 0; p < g_num_params; p++) {
+    if (strcmp(name, g_params[p].name) == 0) {
+      g_params[p].value = value;
+    }
+  }
+  g_publish_params();
+  derived_update();
+}
+
+// Benchmark setups and kernels.
+void h_bench_next_raw() {
+  if (h_bench_recorded) {
+    memcpy(h_bench_frame.raw, frames[h_bench_next_frame++ % num_frames].depth,
+           sizeof(h_bench_frame.raw));
+  } else {
+    scene_render(&h_bench_scene, h_bench_next_frame++*SIM_DT,
+                 h_bench_frame.raw);
+  }
+}
+
+void h_bench_next_depth() {
+  h_bench_next_raw();
+  c_convert(&h_bench_frame);
+}
+
+void h_bench_next_columns() {
+  h_bench_next_depth();
+  a_analyze_columns(h_bench_frame.depth, h_bench_last_col_records);
+  h_bench_next_depth();
+  a_analyze_columns(h_bench_frame.depth, h_bench_frame.col_records);
+}
+
+void h_bench_restore_particles() {
+  num_particles = h_bench_particles;
+  memcpy(particles, h_bench_saved_particles,
+         num_particles*sizeof(particle));
+}
+
+void h_bench_scene_render() {
+  scene_render(&h_bench_scene, h_bench_next_frame++*SIM_DT,
+               h_bench_frame.raw);
+}
+
+void h_bench_convert() {
+  c_convert(&h_bench_frame);
+}
+
+void h_bench_analyze() {
+  a_analyze_columns(h_bench_frame.depth, h_bench_frame.col_records);
+}
+
+void h_bench_emit() {
+  emission e;
+  a_emit_particles(h_bench_frame.col_records, h_bench_last_col_records, &e);
+}
+
+int h_compare_doubles(const void* a, const void* b) {
+  double av = *(double*) a, bv = *(double*) b;
+  return av > bv ? 1 : av < bv ? -1 : 0;
+}
+
+// Times a kernel and writes a CSV line of its timings in microseconds.
+void h_bench(char* kernel, char* variant, void (*setup)(),
+             void (*run)()) {
+  static double samples[100000];
+  double start, sum = 0;
+  int i, reps = h_bench_reps;
+
+  for (i = -BENCH_WARMUP; i < reps; i++) {
+    if (setup) setup();
+    start = get_time();
+    run();
+    if (i >= 0) {
+      samples[i] = (get_time() - start)*1e6;
+      sum += samples[i];
+    }
+  }
+  qsort(samples, reps, sizeof(double), h_compare_doubles);
+  printf("%s,%s,%s,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", kernel, variant,
+         h_bench_recorded ? "recorded" : "synthetic", reps, sum/reps,
+         samples[0], samples[reps/2], samples[reps*9/10], samples[reps*99/100],
+         samples[reps - 1]);
+  fflush(stdout);
+}
+
+// Benchmarks the kernels of the pipeline, on synthetic frames and then on
+// the recorded frames in recording (if not NULL), and writes a CSV line for
+// each to stdout.  The preview is drawn by a shader, which needs a window,
+// so it isn't covered here.
+int h_bench_all(char* recording) {
+  int counts[] = {100, 500, 2000};
+  char variant[100];
+  char* reps_env = getenv("BENCH_REPS");
+  particle* p;
+  int i, rot;
+  float base_rot;
+  FILE* fp;
+
+  h_bench_reps = reps_env ? atoi(reps_env) : BENCH_DEFAULT_REPS;
+  h_bench_reps = h_bench_reps < 1 ? 1 : h_bench_reps > 100000 ?
+      100000 : h_bench_reps;
+  if (recording) {
+    fp = fopen(recording, "r");
+    if (!fp) {
+      fprintf(stderr, "Could not read %s\n", recording);
+      return 1;
+    }
+    f_read_frames(fp);
+    fclose(fp);
+  }
+  color_init();
+  load_layout();
+  g_publish_params();
+  derived_update();
+  base_rot = cam_rot;
+  scene_init(&h_bench_scene);
+
+  printf("kernel,variant,input,reps,mean_us,min_us,p50_us,p90_us,p99_us,"
+         "max_us\n");
+  for (h_bench_recorded = 0; h_bench_recorded <= (num_frames > 0);
+       h_bench_recorded++) {
+    for (rot = 0; rot < 4; rot++) {
+      h_set_param("cam_rot", rot);
+      sprintf(variant, "cam_rot=%d", rot);
+      h_bench("c_convert", variant, h_bench_next_raw, h_bench_convert);
+    }
+    h_set_param("cam_rot", base_rot);
+    h_bench("a_analyze_columns", "", h_bench_next_depth, h_bench_analyze);
+    h_bench("a_emit_particles", "", h_bench_next_columns, h_bench_emit);
+  }
+
+  // The particle kernels run on a fixture, so only once.
+  h_bench_recorded = 0;
+  for (i = 0, p = h_bench_saved_particles; i < MAX_PARTICLES; i++, p++) {
+    p->c = i % 25;
+    p->r = p->last_r = (i*7) % 50;
+    p->v = ((i % 11) - 5)*0.1;
+    p->hue = i*0.013;
+    p->sat = 1;
+    p->val = p->last_val = 0.2 + (i % 5)*0.1;
+  }
+  for (i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+    h_bench_particles = counts[i];
+    sprintf(variant, "particles=%d", counts[i]);
+    h_bench("r_advance_particles", variant, h_bench_restore_particles,
+            r_advance_particles);
+    h_bench("r_draw_particles", variant, h_bench_restore_particles,
+            r_draw_particles);
+  }
+  h_bench("r_put_pixels", "", NULL, r_put_pixels);
+
+  // And the synthetic input itself, with a crowd.
+  scene_set(&h_bench_scene, "people", 20);
+  h_bench("scene_render", "people=20", NULL, h_bench_scene_render);
+  return 0;
+}
+
+// Plays f_scene at SIM_HZ, as if it came from the Kinect.
+void* f_scene_main(void* arg) {
+  static u16 raw[640*480];
+  double next = get_time(), now;
+  trace_thread("capture");
+  while (!f_should_quit) {
+    if (!f_paused) {
+      f_playback_clock += SIM_DT;
+      scene_render(&f_scene, f_playback_clock, raw);
+    }
+    f_depth_callback(NULL, raw, 0);
+    next += SIM_DT;
+    now = get_time();
+    if (next > now) {
+      usleep((next - now)*1e6);
+    } else {
+      next = now;  // rendering the scene takes longer than a frame
+    }
+  }
+  fprintf(stderr, "\n");
+  return NULL;
+}
+
+// Adds a slice to the output for address, creating the output if needed.
+int add_output_slice(char* address, int channel, int start, int count) {
+  int i;
+  for (i = 0; i < num_outputs; i++) {
+    if (strcmp(output_addresses[i], address) == 0) break;
+  }
+  if (i == num_outputs) {
+    if (num_outputs >= MAX_OUTPUTS) return 0;
+    if (strncmp(address, "artnet:", 7) == 0) {
+      output_init(&outputs[i], OUTPUT_ARTNET, artnet_new_sink(address + 7));
+    } else {
+      output_init(&outputs[i], OUTPUT_OPC, opc_new_sink(address));
+    }
+    if (outputs[i].sink < 0) return 0;
+    strncpy(output_addresses[i], address, 99);
+    num_outputs++;
+  }
+  output_add_slice(&outputs[i], channel, start, count);
+  return 1;
+}
+
+// Picks up where the last run left off, if it was recent enough: restores
+// the params, the last column records (so the first frame emits as if
+// nothing had happened) and the particles.
+void warm_start() {
+  int p;
+  if (!warm) {
+    return;
+  }
+  if (checkpoint_valid(&warm->params_section, WARM_MAX_AGE)) {
+    for (p = 0; p < g_num_params; p++) {
+      g_params[p].value = warm->params[p];
+    }
+  }
+  if (checkpoint_valid(&warm->columns_section, WARM_MAX_AGE)) {
+    memcpy(a_last_col_records, warm->col_records, sizeof(a_last_col_records));
+  }
+  if (checkpoint_valid(&warm->particles_section, WARM_MAX_AGE) &&
+      warm->num_particles >= 0 && warm->num_particles <= MAX_PARTICLES) {
+    num_particles = warm->num_particles;
+    memcpy(particles, warm->particles, num_particles*sizeof(particle));
+    fprintf(stderr, "Warm start with %d particles.\n", num_particles);
+  }
+}
+
+int main(int argc, char** argv) {
+  char* metrics_address;
+  FILE* fp;
+  int i;
+  depth_frame* f;
+  char address[100];
+  int channel, start, count;
+
+  for (g_num_params = 0; g_params[g_num_params].name; g_num_params++);
+  g_load_params("current.params");
+  if (argc > 3 && strcmp(argv[1], "-sweep") == 0) {
+    return h_sweep(argv[2], argc - 3, argv + 3);
+  }
+  if (argc > 3 && strcmp(argv[1], "-golden") == 0) {
+    return h_golden(argv[2], argv[3], 0);
+  }
+  if (argc > 3 && strcmp(argv[1], "-golden-update") == 0) {
+    return h_golden(argv[2], argv[3], 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+    return h_bench_all(argc > 2 ? argv[2] : NULL);
+  }
+  warm = checkpoint_open(WARM_SHM, sizeof(warm_state), WARM_VERSION);
+  warm_start();
+  g_publish_params();
+  runtime_load("runtime.txt");
+  trace_request_on_signal(SIGUSR1);
+  pthread_create(&s_thread, NULL, s_main, NULL);
+  runtime_apply("save", s_thread);
+
+  load_layout();
+
+  // Each line of outputs.txt is "<host:port> <channel> <start> <count>",
+  // sending count pixels of the output stream from start to that channel.
+  // For "artnet:<host:port>", the channel is the first DMX universe.
+  fp = fopen("outputs.txt", "r");
+  if (fp) {
+    while (fscanf(fp, "%99s %d %d %d\n",
+                  address, &channel, &start, &count) == 4) {
+      if (start < 0 || count < 0 ||
+          !add_output_slice(address, channel, start, count)) {
+        fprintf(stderr, "Bad output in outputs.txt: %s\n", address);
+        exit(1);
+      }
+    }
+    fclose(fp);
+  }
+  r_update_out_map();
+  r_out_count_sent = r_out_count;
+  if (argc > 1 && !num_outputs) {
+    if (!add_output_slice(argv[1], 1, 0, r_out_count)) {
       fprintf(stderr, "Usage: %s <address>\n", argv[0]);
       exit(1);
     }
+    r_default_output = 0;
   }
-  if (argc > 2) {
+  // Set up the heartbeats for the watchdog.
+  heartbeats = heartbeat_open(HEARTBEAT_SHM);
+  f_heartbeat = heartbeat_add(heartbeats, "capture");
+  convert_stage.heartbeat = heartbeat_add(heartbeats, "convert");
+  analyze_stage.heartbeat = heartbeat_add(heartbeats, "analyze");
+  render_stage.heartbeat = heartbeat_add(heartbeats, "render");
+  g_heartbeat = heartbeat_add(heartbeats, "glut");
+  for (i = 0; i < num_outputs; i++) {
+    snprintf(address, sizeof(address), "output %d", i);
+    outputs[i].heartbeat = heartbeat_add(heartbeats, address);
+  }
+
+  for (i = 0; i < num_outputs; i++) {
+    output_start(&outputs[i]);
+    runtime_apply("output", outputs[i].thread);
+  }
+
+  // Export the latency histograms for Prometheus, at $METRICS_ADDRESS
+  // ("<host>:<port>", or "" for none).
+  metrics_add("play_stage_seconds", "Time spent on each item, by stage.",
+              &capture_stage.busy_hist, "stage=\"capture\"");
+  metrics_add("play_stage_seconds", "", &convert_stage.busy_hist,
+              "stage=\"convert\"");
+  metrics_add("play_stage_seconds", "", &analyze_stage.busy_hist,
+              "stage=\"analyze\"");
+  metrics_add("play_stage_seconds", "", &emission_hist,
+              "stage=\"emission\"");
+  metrics_add("play_stage_seconds", "", &render_stage.busy_hist,
+              "stage=\"render\"");
+  metrics_add("play_stage_seconds", "", &preview_stage.busy_hist,
+              "stage=\"preview\"");
+  metrics_add("play_latency_seconds", "Time since a frame was captured.",
+              &capture_to_analysis_hist, "until=\"analysis\"");
+  metrics_add("play_latency_seconds", "", &end_to_end_hist,
+              "until=\"output\"");
+  for (i = 0; i < num_outputs; i++) {
+    snprintf(output_labels[i], sizeof(output_labels[i]),
+             "output=\"%.99s\"", output_addresses[i]);
+    metrics_add("play_output_send_seconds", "Time taken to send a frame.",
+                &outputs[i].send_hist, output_labels[i]);
+  }
+  metrics_address = getenv("METRICS_ADDRESS");
+  metrics_address = metrics_address ? metrics_address : METRICS_ADDRESS;
+  if (metrics_address[0]) {
+    metrics_start(metrics_address);
+  }
+
+  // Set up the pipeline.
+  queue_init(&free_frames, NUM_DEPTH_FRAMES, sizeof(depth_frame*));
+  queue_init(&skipped_frames, NUM_DEPTH_FRAMES, sizeof(depth_frame*));
+  queue_init(&convert_queue, NUM_DEPTH_FRAMES, sizeof(depth_frame*));
+  queue_init(&analyze_queue, NUM_DEPTH_FRAMES, sizeof(depth_frame*));
+  queue_init(&preview_queue, 2, sizeof(depth_frame*));
+  queue_init(&emission_queue, 8, sizeof(emission));
+  for (i = 0; i < NUM_DEPTH_FRAMES; i++) {
+    f = &depth_frames[i];
+    queue_push(&free_frames, &f);
+  }
+  runtime_lock(depth_frames, sizeof(depth_frames));
+  runtime_lock(emission_queue.items,
+               emission_queue.capacity*emission_queue.item_size);
+  runtime_lock(particles, sizeof(particles));
+  runtime_lock(r_levels, sizeof(r_levels));
+  runtime_lock(r_dither, sizeof(r_dither));
+  runtime_lock(&r_lut, sizeof(r_lut));
+  runtime_lock(r_out_map, sizeof(r_out_map));
+  pthread_create(&c_thread, NULL, c_main, NULL);
+  runtime_apply("convert", c_thread);
+  pthread_create(&a_thread, NULL, a_main, NULL);
+  runtime_apply("analyze", a_thread);
+
+  if (argc > 3 && strcmp(argv[2], "-scene") == 0) {
+    scene_init(&f_scene);
+    if (!scene_load(&f_scene, argv[3])) {
+      fprintf(stderr, "Usage: %s <address> -scene <script>\n", argv[0]);
+      exit(1);
+    }
+    pthread_create(&f_thread, NULL, f_scene_main, NULL);
+    runtime_apply("capture", f_thread);
+  } else if (argc > 2) {
     if (strcmp(argv[2], "-") == 0) {
       play_fp = stdin;
     } else {
@@ -878,15 +2598,11 @@ int main(int argc, char** argv) {
       }
     }
 
-    frames = malloc(MAX_FRAMES*sizeof(frame));
-    for (num_frames = 0; num_frames < MAX_FRAMES; num_frames++) {
-      if (fread(&(frames[num_frames]), sizeof(frame), 1, play_fp) == 0) {
-        break;
-      }
-    }
+    f_read_frames(play_fp);
     fprintf(stderr, "Read %d frame%s.\n",
             num_frames, num_frames == 1 ? "" : "s");
     pthread_create(&f_thread, NULL, f_playback_main, NULL);
+    runtime_apply("capture", f_thread);
   } else {
     // Open Freenect device 0.
     if (freenect_init(&f_context, NULL) < 0) {
@@ -905,7 +2621,9 @@ int main(int argc, char** argv) {
       fprintf(stderr, "freenect_open_device failed\n");
       return 1;
     }
+    f_start_time = get_time();
     pthread_create(&f_thread, NULL, f_main, NULL);
+    runtime_apply("capture", f_thread);
   }
 
   g_main(NULL); // Mac OS X requires GLUT to run on the main thread
@@ -0,0 +1,89 @@
+#define GL_GLEXT_PROTOTYPES
+#include <stdlib.h>
+#include <string.h>
+
+#include "preview.h"
+#include "clock.h"
+
+double preview_hz = -1;
+static int preview_visible = 1;
+static double preview_next_time = 0;
+
+void preview_texture_init(preview_texture* t, int width, int height,
+                          GLint internal_format, GLenum format, GLenum type,
+                          int pixel_bytes) {
+  t->width = width;
+  t->height = height;
+  t->format = format;
+  t->type = type;
+  t->size = width*height*pixel_bytes;
+  t->current = 0;
+
+  glGenTextures(1, &t->texture);
+  glBindTexture(GL_TEXTURE_2D, t->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0,
+               format, type, NULL);
+
+  glGenBuffers(2, t->buffers);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t->buffers[0]);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, t->size, NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t->buffers[1]);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, t->size, NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void preview_texture_free(preview_texture* t) {
+  glDeleteBuffers(2, t->buffers);
+  glDeleteTextures(1, &t->texture);
+}
+
+void preview_texture_upload(preview_texture* t, void* data) {
+  void* mapped;
+
+  // Fill the buffer not used last time.  Respecifying its storage first
+  // lets the driver hand over fresh memory instead of waiting for the GPU.
+  t->current = !t->current;
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t->buffers[t->current]);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, t->size, NULL, GL_STREAM_DRAW);
+  mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+  glBindTexture(GL_TEXTURE_2D, t->texture);
+  if (mapped) {
+    memcpy(mapped, data, t->size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    // The copy into the texture proceeds asynchronously from the buffer.
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, t->width, t->height,
+                    t->format, t->type, 0);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void preview_window_status(int state) {
+  preview_visible = state != GLUT_HIDDEN && state != GLUT_FULLY_COVERED;
+}
+
+double preview_delay() {
+  double now = get_time();
+  char* env;
+
+  if (preview_hz < 0) {
+    env = getenv("PREVIEW_HZ");
+    preview_hz = env ? atof(env) : PREVIEW_DEFAULT_HZ;
+  }
+  if (!preview_visible || preview_hz <= 0) {
+    return 1.0/PREVIEW_DEFAULT_HZ;
+  }
+  return now < preview_next_time ? preview_next_time - now : 0;
+}
+
+void preview_drawn() {
+  double now = get_time();
+  double interval = preview_hz > 0 ? 1.0/preview_hz : 0;
+
+  // Keep to the schedule, but don't try to catch up after a gap.
+  preview_next_time += interval;
+  if (preview_next_time < now) {
+    preview_next_time = now + interval;
+  }
+}
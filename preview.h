@@ -0,0 +1,56 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#ifdef __APPLE__
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+
+// Helpers for the on-screen previews, which are only diagnostics and should
+// cost as little as possible.
+
+#define PREVIEW_DEFAULT_HZ 10
+
+// How often to check for a frame once a preview frame is due.
+#define PREVIEW_POLL_INTERVAL 0.005
+
+// A texture allocated once and updated through two pixel buffer objects in
+// turn, so that uploading a frame doesn't wait for the GPU to finish with
+// the previous one.
+typedef struct {
+  GLuint texture;
+  GLuint buffers[2];
+  int current;  // the buffer most recently filled
+  int width, height;
+  GLenum format, type;
+  int size;  // bytes per frame
+} preview_texture;
+
+// Creates the texture; format and type describe the frames passed to
+// preview_texture_upload, which have pixel_bytes bytes per pixel.
+void preview_texture_init(preview_texture* t, int width, int height,
+                          GLint internal_format, GLenum format, GLenum type,
+                          int pixel_bytes);
+void preview_texture_free(preview_texture* t);
+
+// Streams a frame into the texture, leaving the texture bound.
+void preview_texture_upload(preview_texture* t, void* data);
+
+// The preview rate in Hz; 0 turns the preview off.  It starts at
+// $PREVIEW_HZ, or PREVIEW_DEFAULT_HZ.
+extern double preview_hz;
+
+// Pass to glutWindowStatusFunc() to suspend the preview while the window is
+// hidden or covered.
+void preview_window_status(int state);
+
+// Seconds until the next preview frame is due, or 0 if it is due now.
+// While the window can't be seen or the preview is off, no frame is due and
+// this is just an interval to check back after.
+double preview_delay();
+
+// Call after drawing a preview frame to schedule the next one.
+void preview_drawn();
+
+#endif
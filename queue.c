@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "queue.h"
+
+void queue_init(queue* q, int capacity, int item_size) {
+  q->capacity = 1;
+  while (q->capacity < capacity) {
+    q->capacity <<= 1;
+  }
+  q->item_size = item_size;
+  q->items = calloc(q->capacity, item_size);
+  q->head = q->tail = 0;
+  q->full = 0;
+  q->waiting = 0;
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->cond, NULL);
+}
+
+int queue_push(queue* q, void* item) {
+  u32 tail = q->tail;
+  if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= q->capacity) {
+    q->full++;
+    return 0;
+  }
+  memcpy(q->items + (tail & (q->capacity - 1))*q->item_size,
+         item, q->item_size);
+  // The consumer either sees the new tail before it sleeps, or is already
+  // waiting on the condition by the time the mutex is free.
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+  }
+  return 1;
+}
+
+int queue_pop(queue* q, void* item) {
+  u32 head = q->head;
+  if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  memcpy(item, q->items + (head & (q->capacity - 1))*q->item_size,
+         q->item_size);
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int queue_wait(queue* q, void* item, double timeout) {
+  struct timeval tv;
+  struct timespec deadline;
+  int timed_out = 0;
+
+  if (queue_pop(q, item)) {
+    return 1;
+  }
+  gettimeofday(&tv, NULL);
+  timeout += tv.tv_sec + tv.tv_usec/1e6;
+  deadline.tv_sec = timeout;
+  deadline.tv_nsec = (timeout - deadline.tv_sec)*1e9;
+
+  pthread_mutex_lock(&q->mutex);
+  __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+  while (!timed_out &&
+         __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) == q->head) {
+    timed_out = pthread_cond_timedwait(&q->cond, &q->mutex, &deadline);
+  }
+  __atomic_store_n(&q->waiting, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&q->mutex);
+  return queue_pop(q, item);
+}
+
+int queue_count(queue* q) {
+  return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) -
+      __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
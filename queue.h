@@ -0,0 +1,39 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+
+#include "opc.h"
+
+// A bounded queue of fixed-size items between one producer thread and one
+// consumer thread.  Pushing and popping never block or take a lock; the
+// consumer can sleep in queue_wait() until an item arrives.
+typedef struct {
+  char* items;
+  int item_size;
+  u32 capacity;  // a power of 2
+  u32 head, tail;  // next item to pop, next slot to push
+  u32 full;  // pushes refused because the queue was full
+  int waiting;  // the consumer is asleep in queue_wait()
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} queue;
+
+// Sets up a queue that holds up to capacity items (rounded up to a power
+// of 2) of item_size bytes each.
+void queue_init(queue* q, int capacity, int item_size);
+
+// Copies an item in and returns 1, or returns 0 if the queue is full.
+int queue_push(queue* q, void* item);
+
+// Copies the oldest item out and returns 1, or returns 0 if the queue is
+// empty.
+int queue_pop(queue* q, void* item);
+
+// Like queue_pop(), but waits up to timeout seconds for an item.
+int queue_wait(queue* q, void* item, double timeout);
+
+// The number of items queued.
+int queue_count(queue* q);
+
+#endif
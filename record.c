@@ -9,6 +9,7 @@
 
 #include "libfreenect.h"
 #include "opc.h"
+#include "color.h"
 
 pthread_mutex_t frame_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t frame_ready_cond = PTHREAD_COND_INITIALIZER;
@@ -139,22 +140,10 @@ void g_exit() {
   exit(0);
 }
 
-#define set_pixel(p, nr, ng, nb) ((p).r = nr, (p).g = ng, (p).b = nb)
+pixel f_depth_colors[2048];
 
 void f_draw(u16* depth) {
-  for (int i = 0; i < 640*480; i++) {
-    int v = depth[i] * (256*6) / 1090;
-    int hi = v >> 8, lo = v & 0xff;
-    pixel p;
-    hi == 0 ? set_pixel(p, 255, 255 - lo, 255 - lo) :
-        hi == 1 ? set_pixel(p, 255, lo, 0) :
-        hi == 2 ? set_pixel(p, 255 - lo, 255, 0) :
-        hi == 3 ? set_pixel(p, 0, 255, lo) :
-        hi == 4 ? set_pixel(p, 0, 255 - lo, 255) :
-        hi == 5 ? set_pixel(p, 0, 0, 255 - lo) :
-        set_pixel(p, 0, 0, 0);
-    f_frame[i] = p;
-  }
+  color_map_depth(f_frame, depth, 640*480, f_depth_colors, 2047);
 }
 
 void f_depth_callback(freenect_device* dev, void* data, u32 timestamp) {
@@ -207,6 +196,9 @@ int main(int argc, char** argv) {
   }
 
   frames = malloc(MAX_FRAMES*sizeof(frame));
+  for (int i = 0; i < 2048; i++) {
+    f_depth_colors[i] = color_kinect_ramp(i * (256*6) / 1090);
+  }
 
   // Start both threads.
   pthread_create(&f_thread, NULL, f_main, NULL);
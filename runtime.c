@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "runtime.h"
+
+typedef struct {
+  char name[20];
+  int cpu;  // -1 for any
+  int priority;  // SCHED_FIFO priority, or 0 for normal scheduling
+} runtime_rule;
+
+typedef struct {
+  char name[20];
+  pthread_t thread;
+  runtime_rule* rule;
+  int cpu_error, priority_error;  // errno values from applying the rule
+} runtime_thread;
+
+static runtime_rule runtime_rules[RUNTIME_MAX_RULES];
+static int runtime_num_rules = 0;
+static runtime_thread runtime_threads[RUNTIME_MAX_THREADS];
+static int runtime_num_threads = 0;
+static int runtime_locking = 0;
+static size_t runtime_locked = 0, runtime_lock_failed = 0;
+static int runtime_lock_error = 0;
+
+int runtime_load(char* filename) {
+  FILE* fp = fopen(filename, "r");
+  char line[200], name[20];
+  runtime_rule* r;
+  int cpu, priority;
+
+  if (!fp) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#' || sscanf(line, "%19s", name) != 1) continue;
+    if (strcmp(name, "lock") == 0) {
+      runtime_locking = 1;
+    } else if (sscanf(line, "%19s %d %d", name, &cpu, &priority) == 3 &&
+               runtime_num_rules < RUNTIME_MAX_RULES) {
+      r = &runtime_rules[runtime_num_rules++];
+      strcpy(r->name, name);
+      r->cpu = cpu;
+      r->priority = priority;
+    } else {
+      fprintf(stderr, "Bad line in %s: %s", filename, line);
+    }
+  }
+  fclose(fp);
+  return 1;
+}
+
+static int runtime_set_cpu(pthread_t thread, int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+  return ENOTSUP;
+#endif
+}
+
+void runtime_apply(char* name, pthread_t thread) {
+  runtime_thread* t;
+  struct sched_param param;
+  int i;
+
+  if (runtime_num_threads >= RUNTIME_MAX_THREADS) return;
+  t = &runtime_threads[runtime_num_threads++];
+  strncpy(t->name, name, sizeof(t->name) - 1);
+  t->thread = thread;
+  t->rule = NULL;
+  t->cpu_error = t->priority_error = 0;
+  for (i = 0; i < runtime_num_rules; i++) {
+    if (strcmp(runtime_rules[i].name, name) == 0) {
+      t->rule = &runtime_rules[i];
+    }
+  }
+  if (!t->rule) return;
+
+  if (t->rule->cpu >= 0) {
+    t->cpu_error = runtime_set_cpu(thread, t->rule->cpu);
+  }
+  if (t->rule->priority > 0) {
+    param.sched_priority = t->rule->priority;
+    t->priority_error = pthread_setschedparam(thread, SCHED_FIFO, &param);
+  }
+}
+
+void runtime_lock(void* p, size_t size) {
+  if (!runtime_locking) return;
+  if (mlock(p, size) == 0) {
+    runtime_locked += size;
+  } else {
+    runtime_lock_failed += size;
+    runtime_lock_error = errno;
+  }
+}
+
+// Describes the cores a thread may run on, like "1" or "0-3".
+static void runtime_describe_cpus(pthread_t thread, char* out, int size) {
+#ifdef __linux__
+  cpu_set_t set;
+  int cpu, first = -1, n = 0;
+
+  out[0] = 0;
+  if (pthread_getaffinity_np(thread, sizeof(set), &set)) {
+    snprintf(out, size, "?");
+    return;
+  }
+  for (cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set)) {
+      if (first < 0) first = cpu;
+    } else if (first >= 0) {
+      n += snprintf(out + n, n < size ? size - n : 0, "%s%d", n ? "," : "",
+                    first);
+      if (cpu - 1 > first) {
+        n += snprintf(out + n, n < size ? size - n : 0, "-%d", cpu - 1);
+      }
+      first = -1;
+    }
+  }
+#else
+  snprintf(out, size, "any");
+#endif
+}
+
+void runtime_report(FILE* fp) {
+  runtime_thread* t;
+  struct sched_param param;
+  char cpus[100];
+  int i, policy, refused = 0;
+
+  if (!runtime_num_rules && !runtime_locking) return;
+  fprintf(fp, "thread    cpus        scheduling\n");
+  for (i = 0; i < runtime_num_threads; i++) {
+    t = &runtime_threads[i];
+    runtime_describe_cpus(t->thread, cpus, sizeof(cpus));
+    if (pthread_getschedparam(t->thread, &policy, &param)) {
+      policy = -1;
+    }
+    fprintf(fp, "%-9s %-11s %s", t->name, cpus,
+            policy == SCHED_FIFO ? "fifo" :
+            policy == SCHED_RR ? "rr" :
+            policy == SCHED_OTHER ? "normal" : "?");
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+      fprintf(fp, " %d", param.sched_priority);
+    }
+    if (t->cpu_error) {
+      fprintf(fp, "  (cpu %d refused: %s)",
+              t->rule->cpu, strerror(t->cpu_error));
+    }
+    if (t->priority_error) {
+      fprintf(fp, "  (fifo %d refused: %s)",
+              t->rule->priority, strerror(t->priority_error));
+      refused = refused || t->priority_error == EPERM;
+    }
+    fprintf(fp, "\n");
+  }
+  if (refused) {
+    fprintf(fp, "Real-time priorities need CAP_SYS_NICE or an rtprio limit "
+            "in /etc/security/limits.conf.\n");
+  }
+  if (runtime_locking) {
+    fprintf(fp, "Locked %.1f MB of buffers in memory", runtime_locked/1e6);
+    if (runtime_lock_failed) {
+      fprintf(fp, "; %.1f MB refused (%s; see ulimit -l)",
+              runtime_lock_failed/1e6, strerror(runtime_lock_error));
+    }
+    fprintf(fp, ".\n");
+  }
+}
@@ -0,0 +1,34 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// A runtime profile says which cores the named threads run on, which of
+// them get SCHED_FIFO priorities, and whether hot buffers are locked into
+// memory.  Anything the system refuses (usually for lack of privileges) is
+// reported and otherwise ignored, leaving the default scheduling.
+//
+// Each line of the profile is either "<thread> <cpu> <priority>", where a
+// cpu of -1 means any core and a priority of 0 means normal scheduling, or
+// "lock", to lock the buffers passed to runtime_lock().  Lines starting
+// with # are ignored.
+#define RUNTIME_MAX_RULES 16
+#define RUNTIME_MAX_THREADS 32
+
+// Reads the profile from a file.  Returns 0 if there is no such file, in
+// which case nothing is changed.
+int runtime_load(char* filename);
+
+// Applies the profile's rule for name, if any, to a thread, and remembers
+// the thread for runtime_report().
+void runtime_apply(char* name, pthread_t thread);
+
+// Locks size bytes at p into memory, if the profile asks for it.
+void runtime_lock(void* p, size_t size);
+
+// Prints the scheduling each remembered thread actually has, and what was
+// locked.
+void runtime_report(FILE* fp);
+
+#endif
@@ -0,0 +1,279 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "scene.h"
+
+// The Kinect's IR projector sits this far to one side of its camera, so
+// near objects cast shadows on what lies behind them.
+#define SCENE_BASELINE 75
+
+// The height of the camera when no floor is visible.
+#define SCENE_DEFAULT_HEIGHT 1000
+
+static u32 scene_rand(scene* s) {
+  u32 x = s->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return s->random = x;
+}
+
+// Uniform in [0, 1).
+static float scene_uniform(scene* s) {
+  return (scene_rand(s) >> 8)/16777216.0f;
+}
+
+// Roughly normal, with mean 0 and standard deviation 1.
+static float scene_gaussian(scene* s) {
+  return (scene_uniform(s) + scene_uniform(s) + scene_uniform(s) +
+          scene_uniform(s) - 2)*1.732f;
+}
+
+// The inverse of depth_to_mm() in play.c.
+static u16 scene_mm_to_raw(float mm) {
+  float raw = (3.33f - 1000/mm)/0.00307f + 0.5f;
+  return raw < 0 ? 0 : raw > SCENE_NO_VALUE - 1 ? SCENE_NO_VALUE - 1 : raw;
+}
+
+static void scene_add_person(scene* s, scene_person* p) {
+  p->z = s->near + (s->far - s->near)*scene_uniform(s);
+  p->x = (scene_uniform(s)*2 - 1)*p->z*320/SCENE_FOCAL;
+  p->dir = scene_uniform(s) < 0.5 ? -1 : 1;
+  p->phase = scene_uniform(s)*2*M_PI;
+  p->waving = scene_uniform(s) < s->wave;
+}
+
+void scene_init(scene* s) {
+  memset(s, 0, sizeof(scene));
+  s->people = 1;
+  s->near = 1200;
+  s->far = 2800;
+  s->speed = 1000;
+  s->wave = 0.5;
+  s->wall = 4000;
+  s->floor = 1000;
+  s->noise = 1.5;
+  s->holes = 0.01;
+  s->random = 1;
+}
+
+int scene_set(scene* s, char* name, float value) {
+  int i;
+  if (strcmp(name, "people") == 0) {
+    s->people = value < 0 ? 0 : value > SCENE_MAX_PEOPLE ?
+        SCENE_MAX_PEOPLE : value;
+  } else if (strcmp(name, "near") == 0) {
+    s->near = value;
+  } else if (strcmp(name, "far") == 0) {
+    s->far = value;
+  } else if (strcmp(name, "speed") == 0) {
+    s->speed = value;
+  } else if (strcmp(name, "wave") == 0) {
+    s->wave = value;
+    for (i = 0; i < s->num_persons; i++) {
+      s->persons[i].waving = scene_uniform(s) < value;
+    }
+  } else if (strcmp(name, "wall") == 0) {
+    s->wall = value;
+  } else if (strcmp(name, "floor") == 0) {
+    s->floor = value;
+  } else if (strcmp(name, "noise") == 0) {
+    s->noise = value;
+  } else if (strcmp(name, "holes") == 0) {
+    s->holes = value;
+  } else if (strcmp(name, "flicker") == 0) {
+    s->flicker = value;
+  } else if (strcmp(name, "rotate") == 0) {
+    s->rotate = (int) value & 3;
+  } else if (strcmp(name, "seed") == 0) {
+    s->random = value ? value : 1;
+    s->num_persons = 0;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+int scene_load(scene* s, char* filename) {
+  FILE* fp = fopen(filename, "r");
+  char line[200];
+  scene_event* e;
+
+  if (!fp) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp) && s->num_events < SCENE_MAX_EVENTS) {
+    e = &s->events[s->num_events];
+    if (line[0] == '#' || line[0] == '\n') continue;
+    if (sscanf(line, "%lf %15s %f", &e->time, e->name, &e->value) == 3) {
+      s->num_events++;
+    } else {
+      fprintf(stderr, "Bad line in %s: %s", filename, line);
+    }
+  }
+  fclose(fp);
+  return 1;
+}
+
+// Draws a capsule (the points within r of the segment from a to b, in mm
+// from the centre of a person at z) into the frame, nearest surface first.
+static void scene_draw_capsule(scene* s, scene_person* p, float height,
+                               float ax, float ay, float bx, float by,
+                               float r) {
+  float k = SCENE_FOCAL/p->z;
+  float x0 = 320 + (p->x + ax)*k, y0 = 240 - (ay - height)*k;
+  float x1 = 320 + (p->x + bx)*k, y1 = 240 - (by - height)*k;
+  float rp = r*k, dx = x1 - x0, dy = y1 - y0;
+  float length2 = dx*dx + dy*dy, t, ex, ey, d2, mm;
+  int left = (x0 < x1 ? x0 : x1) - rp, right = (x0 > x1 ? x0 : x1) + rp + 1;
+  int top = (y0 < y1 ? y0 : y1) - rp, bottom = (y0 > y1 ? y0 : y1) + rp + 1;
+  int x, y;
+
+  left = left < 0 ? 0 : left;
+  right = right > 640 ? 640 : right;
+  top = top < 0 ? 0 : top;
+  bottom = bottom > 480 ? 480 : bottom;
+  for (y = top; y < bottom; y++) {
+    for (x = left; x < right; x++) {
+      t = length2 ? ((x - x0)*dx + (y - y0)*dy)/length2 : 0;
+      t = t < 0 ? 0 : t > 1 ? 1 : t;
+      ex = x - (x0 + t*dx);
+      ey = y - (y0 + t*dy);
+      d2 = (ex*ex + ey*ey)/(rp*rp);
+      if (d2 < 1) {
+        mm = p->z - r*sqrtf(1 - d2);
+        if (!s->mm[y*640 + x] || mm < s->mm[y*640 + x]) {
+          s->mm[y*640 + x] = mm;
+        }
+      }
+    }
+  }
+}
+
+static void scene_draw_person(scene* s, scene_person* p, float height) {
+  float step = sinf(p->phase), a;
+  int side;
+
+  scene_draw_capsule(s, p, height, 0, 1590, 0, 1590, 110);
+  scene_draw_capsule(s, p, height, 0, 1000, 0, 1380, 190);
+  for (side = -1; side <= 1; side += 2) {
+    scene_draw_capsule(s, p, height, side*90, 900,
+                       side*90 + side*step*250, 80, 75);
+    if (p->waving) {
+      a = 0.7 + 0.5*sinf(3*p->phase + side);
+      scene_draw_capsule(s, p, height, side*200, 1400,
+                         side*(200 + 600*sinf(a)), 1400 + 600*cosf(a), 50);
+    } else {
+      scene_draw_capsule(s, p, height, side*200, 1400,
+                         side*230 - side*step*150, 800, 50);
+    }
+  }
+}
+
+// Applies the script, and moves everyone along by dt seconds.
+static void scene_advance(scene* s, double dt) {
+  scene_person* p;
+  float edge;
+  int i;
+
+  while (s->next_event < s->num_events &&
+         s->events[s->next_event].time <= s->time) {
+    if (!scene_set(s, s->events[s->next_event].name,
+                   s->events[s->next_event].value)) {
+      fprintf(stderr, "Unknown scene setting: %s\n",
+              s->events[s->next_event].name);
+    }
+    s->next_event++;
+  }
+  while (s->num_persons < s->people) {
+    scene_add_person(s, &s->persons[s->num_persons++]);
+  }
+  s->num_persons = s->people;
+
+  for (i = 0, p = s->persons; i < s->num_persons; i++, p++) {
+    p->x += p->dir*s->speed*dt;
+    p->phase += dt*2*M_PI*s->speed/1400;
+    edge = p->z*320/SCENE_FOCAL + 300;
+    if (p->x*p->dir > edge) {
+      p->dir = -p->dir;
+    }
+  }
+}
+
+void scene_render(scene* s, double t, u16* raw) {
+  float height = s->floor ? s->floor : SCENE_DEFAULT_HEIGHT;
+  float* mm = s->mm;
+  float background, floor, shadow, sigma;
+  double dt;
+  int x, y, i, j, w;
+
+  dt = t > s->time ? t - s->time : 0;
+  s->time = t;
+  scene_advance(s, dt);
+
+  // The floor and the wall, whichever is nearer; 0 where there's neither.
+  for (y = 0; y < 480; y++) {
+    background = s->wall;
+    if (s->floor && y > 240) {
+      floor = s->floor*SCENE_FOCAL/(y - 240);
+      background = !background || floor < background ? floor : background;
+    }
+    for (x = 0; x < 640; x++) {
+      mm[y*640 + x] = background;
+    }
+  }
+
+  for (i = 0; i < s->num_persons; i++) {
+    if (!s->flicker || scene_uniform(s) >= s->flicker) {
+      scene_draw_person(s, &s->persons[i], height);
+    }
+  }
+
+  // Shadow the background just to the left of each near edge.
+  for (y = 0; y < 480; y++) {
+    for (x = 1; x < 640; x++) {
+      i = y*640 + x;
+      if (mm[i] && mm[i - 1] && mm[i - 1] - mm[i] > 100) {
+        shadow = SCENE_BASELINE*SCENE_FOCAL*(1/mm[i] - 1/mm[i - 1]);
+        for (w = 1; w <= shadow && w <= x; w++) {
+          mm[i - w] = 0;
+        }
+      }
+    }
+  }
+
+  // Encode, adding noise and holes, in the camera's orientation.
+  if (s->rotate & 1) {
+    for (i = 0; i < 640*480; i++) {
+      raw[i] = SCENE_NO_VALUE;
+    }
+  }
+  for (y = 0; y < 480; y++) {
+    for (x = 0; x < 640; x++) {
+      i = y*640 + x;
+      switch (s->rotate) {
+        case 0:
+          j = i;
+          break;
+        case 1:
+          if (x < 80 || x >= 560) continue;
+          j = (x - 80)*640 + (479 - y) + 80;
+          break;
+        case 2:
+          j = (479 - y)*640 + (639 - x);
+          break;
+        default:
+          if (x < 80 || x >= 560) continue;
+          j = (479 - (x - 80))*640 + y + 80;
+          break;
+      }
+      if (!mm[i] || (s->holes && scene_uniform(s) < s->holes)) {
+        raw[j] = SCENE_NO_VALUE;
+      } else {
+        sigma = s->noise*mm[i]*mm[i]*1e-6;
+        raw[j] = scene_mm_to_raw(mm[i] + sigma*scene_gaussian(s));
+      }
+    }
+  }
+}
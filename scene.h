@@ -0,0 +1,78 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "opc.h"
+
+// Synthetic depth scenes, for running play without a Kinect.  A scene is
+// people walking back and forth in front of a wall, above a floor, as seen
+// by a camera FOCAL pixels from its image plane; each frame is rendered in
+// millimetres and then encoded as the Kinect's raw 11-bit values, with its
+// noise, the shadows it leaves beside near objects and pixels it can't
+// read (SCENE_NO_VALUE).
+//
+// The settings can be changed over time by a script.  Each line of a
+// script is "<seconds> <setting> <value>", applied once the scene's time
+// reaches seconds, in order of time; lines starting with # are ignored.
+// The settings are:
+//
+//   people   number of people (up to SCENE_MAX_PEOPLE)
+//   near     distance of the nearest people, in mm
+//   far      distance of the furthest people, in mm
+//   speed    walking speed, in mm/s
+//   wave     fraction of people waving their arms, from 0 to 1
+//   wall     distance of the wall, in mm, or 0 for none
+//   floor    height of the camera above a visible floor, in mm, or 0 for none
+//   noise    noise at 1 m, in mm; it grows with the square of the distance
+//   holes    fraction of pixels with no reading
+//   flicker  chance of each person vanishing from any one frame
+//   rotate   quarter turns of the camera, as undone by cam_rot
+//   seed     restarts the random numbers, and so the people
+#define SCENE_MAX_PEOPLE 64
+#define SCENE_MAX_EVENTS 256
+#define SCENE_NO_VALUE 2047
+#define SCENE_FOCAL 580
+
+typedef struct {
+  float x, z;  // mm from the centre of view, and from the camera
+  float dir;  // +1 or -1
+  float phase;  // of walking and waving, in radians
+  int waving;
+} scene_person;
+
+typedef struct {
+  double time;
+  char name[16];
+  float value;
+} scene_event;
+
+typedef struct {
+  // The settings.
+  int people;
+  float near, far, speed, wave, wall, floor, noise, holes, flicker;
+  int rotate;
+
+  // The script.
+  int num_events, next_event;
+  scene_event events[SCENE_MAX_EVENTS];
+
+  // The state.
+  u32 random;
+  double time;
+  int num_persons;
+  scene_person persons[SCENE_MAX_PEOPLE];
+  float mm[640*480];  // the frame being rendered, upright
+} scene;
+
+// Sets up a scene of one person, with default settings and no script.
+void scene_init(scene* s);
+
+// Changes a setting.  Returns 0 if there is no such setting.
+int scene_set(scene* s, char* name, float value);
+
+// Reads a script.  Returns 0 if the file can't be read.
+int scene_load(scene* s, char* filename);
+
+// Advances the scene to t seconds and renders a frame of raw depth values.
+void scene_render(scene* s, double t, u16* raw);
+
+#endif
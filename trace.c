@@ -0,0 +1,127 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+typedef struct {
+  unsigned long long ns;  // monotonic time
+  char* name;
+  u32 item;
+  char phase;  // 'B' or 'E'
+} trace_event;
+
+typedef struct {
+  char name[20];
+  u32 next;  // total events ever recorded; only the last TRACE_EVENTS remain
+  trace_event events[TRACE_EVENTS];
+} trace_ring;
+
+static trace_ring trace_rings[TRACE_MAX_THREADS];
+static int trace_num_rings = 0;
+static __thread trace_ring* trace_my_ring = NULL;
+static volatile sig_atomic_t trace_signalled = 0;
+
+void trace_thread(char* name) {
+  int i = __atomic_fetch_add(&trace_num_rings, 1, __ATOMIC_RELAXED);
+  if (i >= TRACE_MAX_THREADS) return;
+  strncpy(trace_rings[i].name, name, sizeof(trace_rings[i].name) - 1);
+  trace_my_ring = &trace_rings[i];
+}
+
+static inline void trace_record(char* name, u32 item, char phase) {
+  trace_ring* r = trace_my_ring;
+  struct timespec ts;
+  trace_event* e;
+
+  if (!r) return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  e = &r->events[r->next & (TRACE_EVENTS - 1)];
+  // Like a seqlock's writer: the store of next for the previous event must
+  // be seen before any of this event's stores over an older one, so that
+  // trace_copy's second look at next catches the overwrite.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->ns = ts.tv_sec*1000000000ull + ts.tv_nsec;
+  e->name = name;
+  e->item = item;
+  e->phase = phase;
+  __atomic_store_n(&r->next, r->next + 1, __ATOMIC_RELEASE);
+}
+
+void trace_begin(char* name, u32 item) {
+  trace_record(name, item, 'B');
+}
+
+void trace_end(char* name, u32 item) {
+  trace_record(name, item, 'E');
+}
+
+// Copies out the events still in a ring.  The owner keeps recording
+// meanwhile, so any event it may have overwritten during the copy is
+// dropped.  Returns the number of events copied to events.
+static int trace_copy(trace_ring* r, trace_event* events) {
+  u32 first, last, oldest, i, n = 0;
+
+  last = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+  first = last > TRACE_EVENTS ? last - TRACE_EVENTS : 0;
+  for (i = first; i < last; i++) {
+    events[n++] = r->events[i & (TRACE_EVENTS - 1)];
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  // The owner may be writing event next, over event next - TRACE_EVENTS.
+  i = __atomic_load_n(&r->next, __ATOMIC_RELAXED);
+  oldest = i + 1 > TRACE_EVENTS ? i + 1 - TRACE_EVENTS : 0;
+  if (oldest > first) {
+    i = oldest - first < n ? oldest - first : n;
+    n -= i;
+    memmove(events, events + i, n*sizeof(trace_event));
+  }
+  return n;
+}
+
+int trace_write(char* filename) {
+  static trace_event events[TRACE_EVENTS];
+  FILE* fp = fopen(filename, "w");
+  int t, i, n, count = 0, num_rings;
+
+  if (!fp) {
+    return -1;
+  }
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  num_rings = __atomic_load_n(&trace_num_rings, __ATOMIC_RELAXED);
+  num_rings = num_rings < TRACE_MAX_THREADS ? num_rings : TRACE_MAX_THREADS;
+  for (t = 0; t < num_rings; t++) {
+    fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            t ? ",\n" : "", t + 1, trace_rings[t].name);
+    n = trace_copy(&trace_rings[t], events);
+    for (i = 0; i < n; i++) {
+      fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+              "\"pid\": 1, \"tid\": %d, \"args\": {\"item\": %u}}",
+              events[i].name, events[i].phase, events[i].ns/1e3, t + 1,
+              events[i].item);
+    }
+    count += n;
+  }
+  fprintf(fp, "\n]}\n");
+  if (fclose(fp)) {
+    return -1;
+  }
+  return count;
+}
+
+static void trace_signal_handler(int sig) {
+  trace_signalled = 1;
+}
+
+void trace_request_on_signal(int sig) {
+  signal(sig, trace_signal_handler);
+}
+
+int trace_requested() {
+  if (!trace_signalled) return 0;
+  trace_signalled = 0;
+  return 1;
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "opc.h"
+
+// Per-thread rings of timestamped begin/end events, cheap enough to leave
+// on all the time: recording an event reads the monotonic clock and writes
+// into the calling thread's own ring, without locks or atomic
+// read-modify-writes.  The most recent events of every thread can be
+// written out at any time as a Chrome trace (chrome://tracing, Perfetto).
+//
+// Threads record nothing until they call trace_thread().  Event names must
+// be string constants.
+#define TRACE_EVENTS 8192  // per thread; a power of 2
+#define TRACE_MAX_THREADS 32
+
+// Gives the calling thread a ring, under a name shown in the trace.
+void trace_thread(char* name);
+
+// Records the start and end of a span of work on an item (like a frame
+// number) in the calling thread.
+void trace_begin(char* name, u32 item);
+void trace_end(char* name, u32 item);
+
+// Writes the events in every thread's ring to a Chrome trace file.  Returns
+// the number of events written, or -1 if the file can't be written.
+int trace_write(char* filename);
+
+// Makes the signal sig request a trace; see trace_requested().
+void trace_request_on_signal(int sig);
+
+// Returns 1, once, if a trace has been requested by the signal.
+int trace_requested();
+
+#endif